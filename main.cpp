@@ -3,9 +3,16 @@
 #include <iostream>
 #include <map>
 #include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <queue>
+#include <unordered_map>
 #include <SDL3/SDL.h>
 #include <SDL3/SDL_opengl.h>
 #include <geometry.h>
+#ifdef __SSE__
+#include <immintrin.h>
+#endif
 #include "imgui/imgui.h"
 #include "imgui/backends/imgui_impl_opengl3.h"
 #include "imgui/backends/imgui_impl_sdl3.h"
@@ -17,6 +24,117 @@ int bg_width, bg_height, bg_channels;
 const float PI = 3.14159265358979323846;
 const int frame_width = 1920;
 const int frame_height = 1080;
+const char *BVH_TUNING_PATH = "assets/scene.bvhtune";
+
+const int SAH_BINS = 12;
+
+// Bin of a sphere's centroid, computed exactly as the centroid bounds are so no bin falls outside the range
+inline int sah_bin(const Sphere &sp, int axis, float cmin, float k) {
+    AABB b = AABB::from_sphere(sp);
+    int bin = (int)(((b.minim[axis] + b.maxim[axis]) * 0.5f - cmin) * k);
+    return min(SAH_BINS - 1, max(0, bin));
+}
+
+// Binned SAH split (Wald 2007). Returns false when no split is possible or, if allowed, a leaf is cheaper
+bool sah_split(
+    vector<int> &indices,
+    const vector<Sphere> &spheres,
+    int start, int end,
+    const AABB &bbox,
+    const AABB &centroid_bbox,
+    const RenderSettings &settings,
+    bool allow_leaf,
+    int &mid)
+{
+    int count = end - start;
+    float inv_area = 1.f / bbox.surface_area();
+    float best_cost = numeric_limits<float>::infinity();
+    int best_axis = -1, best_bin = -1;
+
+    for (int axis = 0; axis < 3; ++axis) {
+        float cmin = centroid_bbox.minim[axis], cmax = centroid_bbox.maxim[axis];
+        if (cmax <= cmin) continue;
+        float k = SAH_BINS * (1 - 1e-5f) / (cmax - cmin);
+
+        AABB bins[SAH_BINS];
+        int counts[SAH_BINS] = {0};
+        for (int i = start; i < end; ++i) {
+            const Sphere &sp = spheres[indices[i]];
+            int b = sah_bin(sp, axis, cmin, k);
+            counts[b]++;
+            bins[b].expand(AABB::from_sphere(sp));
+        }
+
+        // Sweep right to left, then evaluate each plane left to right
+        float right_area[SAH_BINS];
+        int right_count[SAH_BINS];
+        AABB acc;
+        int acc_count = 0;
+        for (int b = SAH_BINS - 1; b > 0; --b) {
+            acc.expand(bins[b]);
+            acc_count += counts[b];
+            right_area[b] = acc_count ? acc.surface_area() : 0.f;
+            right_count[b] = acc_count;
+        }
+        acc = AABB();
+        acc_count = 0;
+        for (int b = 1; b < SAH_BINS; ++b) {
+            acc.expand(bins[b - 1]);
+            acc_count += counts[b - 1];
+            if (acc_count == 0 || right_count[b] == 0) continue;
+            float cost = settings.sah_traversal_cost + settings.sah_intersect_cost * inv_area * (acc_count * acc.surface_area() + right_count[b] * right_area[b]);
+            if (cost < best_cost) { best_cost = cost; best_axis = axis; best_bin = b; }
+        }
+    }
+
+    if (best_axis < 0) return false;
+    if (allow_leaf && best_cost >= settings.sah_intersect_cost * count) return false;
+
+    float cmin = centroid_bbox.minim[best_axis];
+    float k = SAH_BINS * (1 - 1e-5f) / (centroid_bbox.maxim[best_axis] - cmin);
+    mid = (int)(partition(indices.begin() + start, indices.begin() + end, [&](int idx) {
+        return sah_bin(spheres[idx], best_axis, cmin, k) < best_bin;
+    }) - indices.begin());
+    return true;
+}
+
+// Split sorted Morton codes at their highest differing bit (Karras 2012)
+int morton_split(const vector<unsigned int> &codes, int start, int end) {
+    unsigned int first = codes[start], last = codes[end - 1];
+    if (first == last) return (start + end) / 2;
+    int prefix = __builtin_clz(first ^ last);
+
+    // Last code sharing more than prefix bits with the first one
+    int split = start;
+    int step = end - 1 - start;
+    do {
+        step = (step + 1) >> 1;
+        int probe = split + step;
+        if (probe < end - 1 && __builtin_clz(first ^ codes[probe]) > prefix) split = probe;
+    } while (step > 1);
+    return split + 1;
+}
+
+// Spread the low 10 bits so there are two zero bits between each
+unsigned int expand_bits(unsigned int v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// 30-bit Morton code of p within bounds
+unsigned int morton_code(const Vec3f &p, const AABB &bounds) {
+    Vec3f ext = bounds.maxim - bounds.minim;
+    unsigned int code = 0;
+    for (int a = 0; a < 3; ++a) {
+        float u = ext[a] > 0.f ? (p[a] - bounds.minim[a]) / ext[a] : 0.f;
+        unsigned int q = (unsigned int)min(1023.f, max(0.f, u * 1024.f));
+        code |= expand_bits(q) << (2 - a);
+    }
+    return code;
+}
 
 int build_bvh_recursive(
     vector<BVHNode> &nodes,
@@ -24,7 +142,10 @@ int build_bvh_recursive(
     vector<int> &indices,
     const vector<Sphere> &spheres,
     int start, int end,
-    int maxLeafSize = 4)
+    const RenderSettings &settings,
+    const vector<unsigned int> &morton_codes, // Aligned with indices, Morton builder only
+    int depth = 0,
+    deque<LazyBVHSubtree> *lazy = nullptr)
 {
     // Init node
     int node_index = (int)nodes.size();
@@ -45,7 +166,30 @@ int build_bvh_recursive(
     node.box = bbox;
 
     int count = end - start;
-    if (count <= maxLeafSize) {
+    int maxLeafSize = settings.max_leaf_size;
+    bool must_split = count > maxLeafSize;
+
+    if (lazy && must_split && depth >= settings.lazy_eager_depth) {
+        // Stub, the subtree is built on first visit
+        node.count = -1;
+        node.start = (int)lazy->size();
+        lazy->emplace_back(vector<int>(indices.begin() + start, indices.begin() + end), depth);
+        return node_index;
+    }
+    int mid = -1;
+    bool split = false;
+
+    // Deep nodes fall back to balanced median splits so traversal stacks stay bounded
+    if (count > 1 && depth < BVH_MAX_DEPTH / 2) {
+        if (settings.bvh_builder == BVH_BUILD_SAH) {
+            split = sah_split(indices, spheres, start, end, bbox, centroid_bbox, settings, !must_split, mid);
+        } else if (settings.bvh_builder == BVH_BUILD_MORTON && must_split) {
+            mid = morton_split(morton_codes, start, end);
+            split = true;
+        }
+    }
+
+    if (!split && !must_split) {
         // Primitive to ordered list
         node.start = (int)ordered_indices.size();
         node.count = count;
@@ -53,225 +197,2603 @@ int build_bvh_recursive(
         return node_index;
     }
 
-    // Choose split axis
-    Vec3f ext = centroid_bbox.maxim - centroid_bbox.minim;
-    int axis = 0;
-    if (ext.y > ext.x) axis = 1;
-    if (ext.z > ext[axis]) axis = 2;
+    if (!split) {
+        // Choose split axis
+        Vec3f ext = centroid_bbox.maxim - centroid_bbox.minim;
+        int axis = 0;
+        if (ext.y > ext.x) axis = 1;
+        if (ext.z > ext[axis]) axis = 2;
+
+        // median split: find mid by nth_element
+        mid = (start + end) / 2;
+        nth_element(indices.begin() + start, indices.begin() + mid, indices.begin() + end,
+            [&](int a, int b){
+                AABB ba = AABB::from_sphere(spheres[a]);
+                AABB bb = AABB::from_sphere(spheres[b]);
+                Vec3f ca = (ba.minim + ba.maxim) * 0.5f;
+                Vec3f cb = (bb.minim + bb.maxim) * 0.5f;
+                return ca[axis] < cb[axis];
+            });
+
+        bool degenerate = true;
+        {
+            AABB fa = AABB::from_sphere(spheres[indices[start]]);
+            Vec3f ca = (fa.minim + fa.maxim) * 0.5f;
+            for (int i = start+1; i < end; ++i) {
+                AABB fb = AABB::from_sphere(spheres[indices[i]]);
+                Vec3f cb = (fb.minim + fb.maxim) * 0.5f;
+                if (cb[axis] != ca[axis]) { degenerate = false; break; }
+            }
+        }
+        if (degenerate) {
+            mid = start + (count/2);
+            // Avoid inf recursion
+            sort(indices.begin()+start, indices.begin()+end);
+        }
+    }
+
+    // Build children (recursion may reallocate nodes, so don't write through node)
+    int left = build_bvh_recursive(nodes, ordered_indices, indices, spheres, start, mid, settings, morton_codes, depth + 1, lazy);
+    int right = build_bvh_recursive(nodes, ordered_indices, indices, spheres, mid, end, settings, morton_codes, depth + 1, lazy);
+    nodes[node_index].left = left;
+    nodes[node_index].right = right;
+    return node_index;
+}
+
+// Fill skip links for stackless traversal, valid for any node order
+void link_bvh_skips(vector<BVHNode> &nodes) {
+    if (nodes.empty()) return;
+    nodes[0].skip = -1;
+    vector<int> stack(1, 0);
+    while (!stack.empty()) {
+        const BVHNode &node = nodes[stack.back()];
+        stack.pop_back();
+        if (node.count != 0) continue;
+        nodes[node.left].skip = node.right;
+        nodes[node.right].skip = node.skip;
+        stack.push_back(node.right);
+        stack.push_back(node.left);
+    }
+}
+
+// Build over the given primitives. With lazy set, nodes at lazy_eager_depth become stubs
+void build_bvh_range(
+    const vector<Sphere> &spheres,
+    vector<int> &indices,
+    vector<BVHNode> &out_nodes,
+    vector<int> &out_ordered_indices,
+    const RenderSettings &settings,
+    int depth = 0,
+    deque<LazyBVHSubtree> *lazy = nullptr)
+{
+    out_nodes.clear();
+    out_ordered_indices.clear();
+    int n = (int)indices.size();
+    if (n == 0) return;
+
+    vector<unsigned int> morton_codes;
+    if (settings.bvh_builder == BVH_BUILD_MORTON) {
+        // Sort by 30-bit Morton code of the centre within the centre bounds
+        AABB centers;
+        for (int idx : indices) centers.expand(spheres[idx].center);
+        vector<pair<unsigned int, int>> keyed(n);
+        for (int i = 0; i < n; ++i) keyed[i] = make_pair(morton_code(spheres[indices[i]].center, centers), indices[i]);
+        sort(keyed.begin(), keyed.end());
+        morton_codes.resize(n);
+        for (int i = 0; i < n; ++i) { morton_codes[i] = keyed[i].first; indices[i] = keyed[i].second; }
+    }
+
+    out_nodes.reserve(2 * n);
+    build_bvh_recursive(out_nodes, out_ordered_indices, indices, spheres, 0, n, settings, morton_codes, depth, lazy);
+    link_bvh_skips(out_nodes);
+}
+
+void build_bvh(const vector<Sphere> &spheres, vector<BVHNode> &out_nodes, vector<int> &out_ordered_indices, const RenderSettings &settings, deque<LazyBVHSubtree> *lazy = nullptr) {
+    vector<int> indices(spheres.size());
+    for (int i = 0; i < (int)indices.size(); ++i) indices[i] = i;
+    build_bvh_range(spheres, indices, out_nodes, out_ordered_indices, settings, 0, lazy);
+}
+
+// Thread-safe, once-only build of a stub's subtree
+const LazyBVHSubtree &ensure_lazy_subtree(const Scene &scene, int subtree_idx) {
+    const LazyBVHSubtree &sub = scene.lazy_subtrees[subtree_idx];
+    if (sub.ready.load(memory_order_acquire)) return sub;
+    call_once(sub.built, [&]() {
+        vector<int> indices = sub.indices;
+        build_bvh_range(scene.spheres, indices, sub.nodes, sub.order, scene.settings, sub.depth);
+        sub.ready.store(true, memory_order_release);
+    });
+    return sub;
+}
+
+int lazy_subtrees_built(const Scene &scene) {
+    int built = 0;
+    for (const LazyBVHSubtree &sub : scene.lazy_subtrees) built += sub.ready.load(memory_order_acquire);
+    return built;
+}
+
+// Build every pending subtree and splice it into scene_bvh, leaving an ordinary tree
+void finalize_lazy_bvh(Scene &scene) {
+    vector<BVHNode> &nodes = scene.scene_bvh;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (nodes[i].count >= 0) continue;
+        const LazyBVHSubtree &sub = ensure_lazy_subtree(scene, nodes[i].start);
+
+        // Local root replaces the stub, the rest is appended
+        int node_offset = (int)nodes.size() - 1;
+        int order_offset = (int)scene.bvh_order.size();
+        for (size_t j = 0; j < sub.nodes.size(); ++j) {
+            BVHNode n = sub.nodes[j];
+            if (n.count > 0) n.start += order_offset;
+            else { n.left += node_offset; n.right += node_offset; }
+            if (j == 0) nodes[i] = n;
+            else nodes.push_back(n);
+        }
+        scene.bvh_order.insert(scene.bvh_order.end(), sub.order.begin(), sub.order.end());
+    }
+    scene.lazy_subtrees.clear();
+    link_bvh_skips(nodes);
+}
+
+// Pick up to W descendants of a binary node by repeatedly opening the largest inner child
+template <int W>
+int gather_wide_children(const vector<BVHNode> &bin, int bin_idx, int *slots) {
+    int n = 0;
+    const BVHNode &root = bin[bin_idx];
+    if (root.count > 0) slots[n++] = bin_idx; // Leaf root
+    else { slots[n++] = root.left; slots[n++] = root.right; }
+
+    while (n < W) {
+        int best = -1;
+        float best_area = -1.f;
+        for (int i = 0; i < n; ++i) {
+            const BVHNode &c = bin[slots[i]];
+            if (c.count == 0 && c.box.surface_area() > best_area) { best = i; best_area = c.box.surface_area(); }
+        }
+        if (best < 0) break;
+        int opened = slots[best];
+        slots[best] = bin[opened].left;
+        slots[n++] = bin[opened].right;
+    }
+    return n;
+}
+
+// Collapse binary subtree into W-wide nodes
+template <int W>
+int collapse_bvh_recursive(const vector<BVHNode> &bin, vector<BVHWideNode<W>> &out, int bin_idx) {
+    int wide_index = (int)out.size();
+    out.emplace_back();
+
+    int slots[W];
+    int n = gather_wide_children<W>(bin, bin_idx, slots);
+    for (int i = 0; i < n; ++i) {
+        const BVHNode &c = bin[slots[i]];
+        int child = c.count > 0 ? c.start : collapse_bvh_recursive(bin, out, slots[i]);
+        BVHWideNode<W> &node = out[wide_index]; // Recursion may reallocate
+        for (int a = 0; a < 3; ++a) {
+            node.bounds[a][i] = c.box.minim[a];
+            node.bounds[a + 3][i] = c.box.maxim[a];
+        }
+        node.child[i] = child;
+        node.count[i] = c.count;
+    }
+    out[wide_index].num_children = n;
+    return wide_index;
+}
+
+template <int W>
+void collapse_bvh(const vector<BVHNode> &bin, vector<BVHWideNode<W>> &out_nodes) {
+    out_nodes.clear();
+    if (bin.empty()) return;
+    out_nodes.reserve(bin.size() / (W - 1) + 1);
+    collapse_bvh_recursive(bin, out_nodes, 0);
+}
+
+inline float exp2_int(int e) {
+    // Exact power of two, e in [-126, 127]
+    unsigned int bits = (unsigned int)(e + 127) << 23;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Same as traversal decode. q * 2^e is exact so the only rounding is the add
+inline float dequantize(float origin, int q, float scale) {
+    return origin + (float)q * scale;
+}
+
+// Collapse binary subtree into 4-wide nodes, child bounds conservatively quantized to 8 bits
+int quantize_bvh_recursive(const vector<BVHNode> &bin, vector<BVHQuantNode> &out, int bin_idx) {
+    int quant_index = (int)out.size();
+    out.emplace_back();
+
+    int slots[4];
+    int n = gather_wide_children<4>(bin, bin_idx, slots);
+    AABB parent;
+    for (int i = 0; i < n; ++i) parent.expand(bin[slots[i]].box);
+
+    float scale[3];
+    {
+        BVHQuantNode &node = out[quant_index];
+        for (int a = 0; a < 3; ++a) {
+            // Smallest power-of-two cell so 255 cells cover the node box
+            float extent = parent.maxim[a] - parent.minim[a];
+            int e = extent > 0.f ? (int)ceilf(log2f(extent / 255.f)) : -126;
+            e = max(-126, min(127, e));
+            while (e < 127 && dequantize(parent.minim[a], 255, exp2_int(e)) < parent.maxim[a]) ++e;
+            node.origin[a] = parent.minim[a];
+            node.exponent[a] = (signed char)e;
+            scale[a] = exp2_int(e);
+        }
+        node.num_children = (unsigned char)n;
+        for (int i = n; i < 4; ++i) {
+            for (int a = 0; a < 3; ++a) { node.qlo[a][i] = 255; node.qhi[a][i] = 0; }
+            node.child[i] = -1;
+            node.count[i] = 0;
+        }
+    }
+
+    for (int i = 0; i < n; ++i) {
+        const BVHNode &c = bin[slots[i]];
+        int child = c.count > 0 ? c.start : quantize_bvh_recursive(bin, out, slots[i]);
+        BVHQuantNode &node = out[quant_index]; // Recursion may reallocate
+        for (int a = 0; a < 3; ++a) {
+            float o = node.origin[a];
+            int lo = (int)floorf((c.box.minim[a] - o) / scale[a]);
+            int hi = (int)ceilf((c.box.maxim[a] - o) / scale[a]);
+            lo = max(0, min(255, lo));
+            hi = max(0, min(255, hi));
+            // Fix up rounding so decoded box always contains the child
+            while (lo > 0 && dequantize(o, lo, scale[a]) > c.box.minim[a]) --lo;
+            while (hi < 255 && dequantize(o, hi, scale[a]) < c.box.maxim[a]) ++hi;
+            node.qlo[a][i] = (unsigned char)lo;
+            node.qhi[a][i] = (unsigned char)hi;
+        }
+        node.child[i] = child;
+        node.count[i] = (unsigned char)c.count; // Leaf sizes are bounded by maxLeafSize
+    }
+    return quant_index;
+}
+
+void quantize_bvh(const vector<BVHNode> &bin, vector<BVHQuantNode> &out_nodes) {
+    out_nodes.clear();
+    if (bin.empty()) return;
+    out_nodes.reserve(bin.size() / 3 + 1);
+    quantize_bvh_recursive(bin, out_nodes, 0);
+}
+
+// Flatten binary subtree depth-first so the left child always follows its parent
+int flatten_bvh_recursive(const vector<BVHNode> &bin, vector<BVHCompactNode> &out, int bin_idx) {
+    int flat_index = (int)out.size();
+    out.emplace_back();
+    const BVHNode &b = bin[bin_idx];
+    for (int a = 0; a < 3; ++a) {
+        out[flat_index].minim[a] = b.box.minim[a];
+        out[flat_index].maxim[a] = b.box.maxim[a];
+    }
+
+    if (b.count > 0) {
+        out[flat_index].offset = b.start;
+        out[flat_index].packed = (unsigned int)b.count;
+        return flat_index;
+    }
+
+    // Split axis is where the child centroids are furthest apart
+    const AABB &l = bin[b.left].box;
+    const AABB &r = bin[b.right].box;
+    Vec3f sep = (r.minim + r.maxim) - (l.minim + l.maxim);
+    int axis = 0;
+    if (fabsf(sep.y) > fabsf(sep.x)) axis = 1;
+    if (fabsf(sep.z) > fabsf(sep[axis])) axis = 2;
+
+    // Traversal takes the offset child as the one on the positive side, swap if needed
+    bool swap = sep[axis] < 0.f;
+    flatten_bvh_recursive(bin, out, swap ? b.right : b.left);
+    int right = flatten_bvh_recursive(bin, out, swap ? b.left : b.right);
+    out[flat_index].offset = right;
+    out[flat_index].packed = (unsigned int)axis << 30;
+    return flat_index;
+}
+
+void flatten_bvh(const vector<BVHNode> &bin, vector<BVHCompactNode> &out_nodes) {
+    out_nodes.clear();
+    if (bin.empty()) return;
+    out_nodes.reserve(bin.size());
+    flatten_bvh_recursive(bin, out_nodes, 0);
+}
+
+// SAH cost of a node from its children's costs, leaves pay per primitive
+float node_sah_cost(const BVHNode &n, float children_cost, const RenderSettings &settings) {
+    if (n.count > 0) return n.box.surface_area() * settings.sah_intersect_cost * n.count;
+    return n.box.surface_area() * settings.sah_traversal_cost + children_cost;
+}
+
+// Total SAH cost normalized by root area
+float bvh_sah_cost(const vector<BVHNode> &nodes, const RenderSettings &settings) {
+    if (nodes.empty()) return 0.f;
+    vector<float> cost(nodes.size(), 0.f);
+    // Children always come after their parent in the builder's output, but not after restructuring
+    vector<int> order;
+    order.reserve(nodes.size());
+    order.push_back(0);
+    for (size_t i = 0; i < order.size(); ++i) {
+        const BVHNode &n = nodes[order[i]];
+        if (n.count == 0) { order.push_back(n.left); order.push_back(n.right); }
+    }
+    for (int i = (int)order.size() - 1; i >= 0; --i) {
+        const BVHNode &n = nodes[order[i]];
+        cost[order[i]] = node_sah_cost(n, n.count != 0 ? 0.f : cost[n.left] + cost[n.right], settings); // Lazy stubs count as empty
+    }
+    float root_area = nodes[0].box.surface_area();
+    return root_area > 0.f ? cost[0] / root_area : 0.f;
+}
+
+// SAH cost of a subtree the final pass may collapse into one leaf when that is cheaper, see
+// Karras & Aila 2013. split_cost < 0 marks a leaf
+float collapsible_sah_cost(float area, int prims, float split_cost, const RenderSettings &settings) {
+    float leaf = area * settings.sah_intersect_cost * prims;
+    if (split_cost < 0.f) return leaf;
+    float inner = area * settings.sah_traversal_cost + split_cost;
+    return prims <= settings.max_leaf_size ? min(leaf, inner) : inner;
+}
+
+const int TREELET_LEAVES = 7;
+
+struct TreeletSolution {
+    int leaves[TREELET_LEAVES];
+    int internals[TREELET_LEAVES - 1];
+    int next_internal;
+    float area[1 << TREELET_LEAVES];
+    float cost[1 << TREELET_LEAVES];
+    int height[1 << TREELET_LEAVES];
+    int prims[1 << TREELET_LEAVES];
+    int split[1 << TREELET_LEAVES];
+};
+
+// Write the optimal topology for leaf subset S into node_idx, reusing the treelet's internal nodes
+void emit_treelet(vector<BVHNode> &nodes, vector<float> &cost, vector<int> &height, vector<int> &prims, TreeletSolution &t, int S, int node_idx) {
+    int sides[2] = {t.split[S], S ^ t.split[S]};
+    int children[2];
+    for (int k = 0; k < 2; ++k) {
+        int X = sides[k];
+        if ((X & (X - 1)) == 0) {
+            children[k] = t.leaves[__builtin_ctz(X)];
+        } else {
+            children[k] = t.internals[t.next_internal++];
+            emit_treelet(nodes, cost, height, prims, t, X, children[k]);
+        }
+    }
+    BVHNode &n = nodes[node_idx];
+    n.left = children[0];
+    n.right = children[1];
+    n.start = -1;
+    n.count = 0;
+    n.box = nodes[children[0]].box;
+    n.box.expand(nodes[children[1]].box);
+    cost[node_idx] = t.cost[S];
+    height[node_idx] = t.height[S];
+    prims[node_idx] = t.prims[S];
+}
+
+// Replace the treelet under root with the SAH-optimal binary tree over its leaves, see Karras & Aila 2013
+bool restructure_treelet(vector<BVHNode> &nodes, vector<float> &cost, vector<int> &height, vector<int> &prims, int root, int root_depth, const RenderSettings &settings) {
+    TreeletSolution t;
+    int n = 0, ni = 0;
+    t.internals[ni++] = root;
+    t.leaves[n++] = nodes[root].left;
+    t.leaves[n++] = nodes[root].right;
+
+    // Grow treelet by opening the largest inner leaf
+    while (n < TREELET_LEAVES) {
+        int best = -1;
+        float best_area = -1.f;
+        for (int i = 0; i < n; ++i) {
+            const BVHNode &c = nodes[t.leaves[i]];
+            if (c.count == 0 && c.box.surface_area() > best_area) { best = i; best_area = c.box.surface_area(); }
+        }
+        if (best < 0) break;
+        int opened = t.leaves[best];
+        t.internals[ni++] = opened;
+        t.leaves[best] = nodes[opened].left;
+        t.leaves[n++] = nodes[opened].right;
+    }
+    if (n < 3) return false;
+
+    // Dynamic programming over leaf subsets, proper subsets are numerically smaller
+    const int full = (1 << n) - 1;
+    for (int S = 1; S <= full; ++S) {
+        AABB b;
+        for (int i = 0; i < n; ++i) if (S & (1 << i)) b.expand(nodes[t.leaves[i]].box);
+        t.area[S] = b.surface_area();
+
+        if ((S & (S - 1)) == 0) {
+            int leaf = t.leaves[__builtin_ctz(S)];
+            t.cost[S] = cost[leaf];
+            t.height[S] = height[leaf];
+            t.prims[S] = prims[leaf];
+            continue;
+        }
+
+        // Each unordered partition once: P always holds the lowest bit of S
+        int low = S & -S;
+        float best = numeric_limits<float>::infinity();
+        for (int P = (S - 1) & S; P; P = (P - 1) & S) {
+            if (!(P & low)) continue;
+            float c = t.cost[P] + t.cost[S ^ P];
+            if (c < best) { best = c; t.split[S] = P; }
+        }
+        t.prims[S] = t.prims[low] + t.prims[S ^ low];
+        t.cost[S] = collapsible_sah_cost(t.area[S], t.prims[S], best, settings);
+        t.height[S] = 1 + max(t.height[t.split[S]], t.height[S ^ t.split[S]]);
+    }
+
+    if (t.cost[full] >= cost[root] * 0.9999f) return false;
+    if (root_depth + t.height[full] > BVH_MAX_DEPTH) return false; // Keep fixed-size traversal stacks safe
+
+    t.next_internal = 1; // internals[0] is the root itself
+    emit_treelet(nodes, cost, height, prims, t, full, root);
+    return true;
+}
+
+// Rebuild depth-first, turning every subtree that is cheaper as a single leaf into one and
+// regrouping its primitives contiguously
+int collapse_bvh_leaves_recursive(const vector<BVHNode> &in, const vector<int> &in_order, const vector<char> &collapse, vector<BVHNode> &out, vector<int> &out_order, int idx) {
+    int out_idx = (int)out.size();
+    out.push_back(in[idx]);
+    if (in[idx].count > 0 || collapse[idx]) {
+        int start = (int)out_order.size();
+        vector<int> stack(1, idx);
+        while (!stack.empty()) {
+            const BVHNode &n = in[stack.back()];
+            stack.pop_back();
+            if (n.count > 0) { out_order.insert(out_order.end(), in_order.begin() + n.start, in_order.begin() + n.start + n.count); continue; }
+            stack.push_back(n.right);
+            stack.push_back(n.left);
+        }
+        out[out_idx].start = start;
+        out[out_idx].count = (int)out_order.size() - start;
+        return out_idx;
+    }
+    int left = collapse_bvh_leaves_recursive(in, in_order, collapse, out, out_order, in[idx].left);
+    int right = collapse_bvh_leaves_recursive(in, in_order, collapse, out, out_order, in[idx].right);
+    out[out_idx].left = left;
+    out[out_idx].right = right;
+    return out_idx;
+}
+
+void collapse_bvh_leaves(vector<BVHNode> &nodes, vector<int> &order, const RenderSettings &settings) {
+    // Bottom-up over a breadth-first order, restructured children may sit before their parents
+    vector<int> bfs(1, 0);
+    for (size_t i = 0; i < bfs.size(); ++i) {
+        const BVHNode &n = nodes[bfs[i]];
+        if (n.count == 0) { bfs.push_back(n.left); bfs.push_back(n.right); }
+    }
+    vector<float> cost(nodes.size(), 0.f);
+    vector<int> prims(nodes.size(), 0);
+    vector<char> collapse(nodes.size(), 0);
+    for (int i = (int)bfs.size() - 1; i >= 0; --i) {
+        const BVHNode &n = nodes[bfs[i]];
+        float area = n.box.surface_area();
+        if (n.count > 0) {
+            prims[bfs[i]] = n.count;
+            cost[bfs[i]] = collapsible_sah_cost(area, n.count, -1.f, settings);
+            continue;
+        }
+        prims[bfs[i]] = prims[n.left] + prims[n.right];
+        cost[bfs[i]] = collapsible_sah_cost(area, prims[bfs[i]], cost[n.left] + cost[n.right], settings);
+        collapse[bfs[i]] = prims[bfs[i]] <= settings.max_leaf_size && cost[bfs[i]] >= area * settings.sah_intersect_cost * prims[bfs[i]];
+    }
+
+    vector<BVHNode> out;
+    vector<int> out_order;
+    out.reserve(nodes.size());
+    out_order.reserve(order.size());
+    collapse_bvh_leaves_recursive(nodes, order, collapse, out, out_order, 0);
+    nodes.swap(out);
+    order.swap(out_order);
+}
+
+// Post-build pass restructuring small treelets to lower SAH cost. Works on any builder's output,
+// best on single-primitive leaves: subtrees up to max_leaf_size are priced as the cheaper of a leaf
+// and a split, and the final collapse pass turns those priced as leaves into leaves.
+// Levels go bottom-up and treelets rooted at the same depth are disjoint, so each level runs in parallel.
+void optimize_bvh_treelets(vector<BVHNode> &nodes, vector<int> &order, const RenderSettings &settings, double budget_ms) {
+    if (nodes.size() < 5) { collapse_bvh_leaves(nodes, order, settings); return; }
+    auto t0 = chrono::steady_clock::now();
+    vector<float> cost(nodes.size(), 0.f);
+    vector<int> height(nodes.size(), 1);
+    vector<int> prims(nodes.size(), 0);
+    bool out_of_time = false;
+
+    for (int pass = 0; pass < 3 && !out_of_time; ++pass) {
+        vector<vector<int>> levels(1, vector<int>(1, 0));
+        while (true) {
+            vector<int> next;
+            for (int idx : levels.back()) {
+                if (nodes[idx].count == 0) { next.push_back(nodes[idx].left); next.push_back(nodes[idx].right); }
+            }
+            if (next.empty()) break;
+            levels.push_back(next);
+        }
+
+        bool changed = false;
+        for (int d = (int)levels.size() - 1; d >= 0; --d) {
+            const vector<int> &level = levels[d];
+            #pragma omp parallel for schedule(dynamic, 64) reduction(||:changed)
+            for (int i = 0; i < (int)level.size(); ++i) {
+                int idx = level[i];
+                const BVHNode &n = nodes[idx];
+                // Children are final, refresh this node before using it as a treelet root
+                prims[idx] = n.count > 0 ? n.count : prims[n.left] + prims[n.right];
+                cost[idx] = collapsible_sah_cost(n.box.surface_area(), prims[idx], n.count > 0 ? -1.f : cost[n.left] + cost[n.right], settings);
+                height[idx] = n.count > 0 ? 1 : 1 + max(height[n.left], height[n.right]);
+                if (n.count > 0 || out_of_time) continue;
+                if (restructure_treelet(nodes, cost, height, prims, idx, d, settings)) changed = true;
+            }
+            if (chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count() > budget_ms) out_of_time = true;
+        }
+        if (!changed) break;
+    }
+    collapse_bvh_leaves(nodes, order, settings);
+}
+
+// Light hierarchy by median split on the longest axis. Each interior node takes one of its
+// children's representatives in proportion to intensity, from a fixed-seed generator so
+// every build picks the same ones
+int build_light_bvh_range(const vector<Light> &lights, vector<int> &idx, int start, int end, vector<LightNode> &nodes, unsigned &seed) {
+    int node_idx = nodes.size();
+    nodes.push_back(LightNode());
+    if (end - start == 1) {
+        LightNode &leaf = nodes[node_idx];
+        leaf.box.expand(lights[idx[start]].position);
+        leaf.intensity = lights[idx[start]].intensity;
+        leaf.light = idx[start];
+        return node_idx;
+    }
+
+    AABB bounds;
+    for (int i = start; i < end; ++i) bounds.expand(lights[idx[i]].position);
+    Vec3f extent = bounds.maxim - bounds.minim;
+    int axis = extent.x > extent.y && extent.x > extent.z ? 0 : (extent.y > extent.z ? 1 : 2);
+    int mid = (start + end) / 2;
+    nth_element(idx.begin() + start, idx.begin() + mid, idx.begin() + end, [&](int a, int b) { return lights[a].position[axis] < lights[b].position[axis]; });
+    int left = build_light_bvh_range(lights, idx, start, mid, nodes, seed);
+    int right = build_light_bvh_range(lights, idx, mid, end, nodes, seed);
+
+    LightNode &node = nodes[node_idx];
+    node.left = left;
+    node.right = right;
+    node.box = nodes[left].box;
+    node.box.expand(nodes[right].box);
+    node.intensity = nodes[left].intensity + nodes[right].intensity;
+    seed = seed * 1664525u + 1013904223u;
+    float u = (seed >> 8) * (1.f / 16777216.f);
+    node.light = u * node.intensity < nodes[left].intensity ? nodes[left].light : nodes[right].light;
+    return node_idx;
+}
+
+void build_light_bvh(const vector<Light> &lights, vector<LightNode> &nodes) {
+    nodes.clear();
+    if (lights.empty()) return;
+    vector<int> idx(lights.size());
+    for (size_t i = 0; i < lights.size(); ++i) idx[i] = i;
+    unsigned seed = 1;
+    build_light_bvh_range(lights, idx, 0, lights.size(), nodes, seed);
+}
+
+void build_scene_bvh(Scene &scene, bool final_quality = false) {
+    // Derived layouts and optimizer passes need the whole tree
+    bool lazy = scene.settings.lazy_bvh && !final_quality && (scene.settings.bvh_layout == BVH_LAYOUT_BINARY || scene.settings.bvh_layout == BVH_LAYOUT_STACKLESS);
+    scene.lazy_subtrees.clear();
+    if (final_quality && scene.settings.treelet_optimize) {
+        // Optimize over single-primitive leaves so the collapse pass picks the leaf sizes
+        RenderSettings fine = scene.settings;
+        fine.max_leaf_size = 1;
+        build_bvh(scene.spheres, scene.scene_bvh, scene.bvh_order, fine);
+        optimize_bvh_treelets(scene.scene_bvh, scene.bvh_order, scene.settings, scene.settings.treelet_budget_ms);
+    } else {
+        build_bvh(scene.spheres, scene.scene_bvh, scene.bvh_order, scene.settings, lazy ? &scene.lazy_subtrees : nullptr);
+    }
+    link_bvh_skips(scene.scene_bvh);
+    build_light_bvh(scene.lights, scene.light_bvh);
+    scene.scene_bvh_compact.clear();
+    scene.scene_bvh4.clear();
+    scene.scene_bvh8.clear();
+    scene.scene_bvh_quant.clear();
+    if (scene.settings.bvh_layout == BVH_LAYOUT_COMPACT) flatten_bvh(scene.scene_bvh, scene.scene_bvh_compact);
+    if (scene.settings.bvh_layout == BVH_LAYOUT_WIDE4) collapse_bvh(scene.scene_bvh, scene.scene_bvh4);
+    if (scene.settings.bvh_layout == BVH_LAYOUT_WIDE8) collapse_bvh(scene.scene_bvh, scene.scene_bvh8);
+    if (scene.settings.bvh_layout == BVH_LAYOUT_QUANTIZED) quantize_bvh(scene.scene_bvh, scene.scene_bvh_quant);
+}
+
+// Node storage of the active layout plus the ordered primitive list
+size_t bvh_memory_bytes(const Scene &scene) {
+    size_t bytes = scene.bvh_order.size() * sizeof(int);
+    switch (scene.settings.bvh_layout) {
+        case BVH_LAYOUT_COMPACT: return bytes + scene.scene_bvh_compact.size() * sizeof(BVHCompactNode);
+        case BVH_LAYOUT_WIDE4: return bytes + scene.scene_bvh4.size() * sizeof(BVHWideNode<4>);
+        case BVH_LAYOUT_WIDE8: return bytes + scene.scene_bvh8.size() * sizeof(BVHWideNode<8>);
+        case BVH_LAYOUT_QUANTIZED: return bytes + scene.scene_bvh_quant.size() * sizeof(BVHQuantNode);
+        default:
+            for (const LazyBVHSubtree &sub : scene.lazy_subtrees) {
+                if (sub.ready.load(memory_order_acquire)) bytes += sub.nodes.size() * sizeof(BVHNode) + sub.order.size() * sizeof(int);
+            }
+            return bytes + scene.scene_bvh.size() * sizeof(BVHNode);
+    }
+}
+
+float slab_t(float plane, float invdir, float org_invdir) {
+#ifdef __FMA__
+    return fmaf(plane, invdir, -org_invdir);
+#else
+    return plane * invdir - org_invdir;
+#endif
+}
+
+// Branch-free slab test, min/max per axis instead of a swap on the direction sign
+bool ray_intersect_aabb(const RayPrecomp &ray, const AABB &b, float t_min = 0.0001f, float t_max = numeric_limits<float>::infinity(), float *t_entry = nullptr) {
+    for (int a = 0; a < 3; ++a) {
+        float t0 = slab_t(b.minim[a], ray.invdir[a], ray.org_invdir[a]);
+        float t1 = slab_t(b.maxim[a], ray.invdir[a], ray.org_invdir[a]);
+        t_min = max(t_min, min(t0, t1));
+        t_max = min(t_max, max(t0, t1));
+    }
+    if (t_entry) *t_entry = t_min;
+    return t_min < t_max;
+}
+
+// Hit point, normal and material of the winning sphere, built once after traversal
+void make_hit_record(const Vec3f &orig, const Vec3f &dir, const Sphere &sphere, float t, Vec3f &hit, Vec3f &N, Material &material) {
+    hit = orig + dir * t;
+    N = (hit - sphere.center).normalize();
+    material = sphere.material;
+}
+
+// Closest hit within one node array, descending into lazy subtrees on demand.
+// Only tracks (best_dist, best_sphere), see make_hit_record
+bool bvh_closest_hit(
+    const Vec3f &orig,
+    const Vec3f &dir,
+    const RayPrecomp &ray,
+    const Scene &scene,
+    const vector<BVHNode> &nodes,
+    const vector<int> &ordered_indices,
+    float &best_dist,
+    int &best_sphere,
+    vector<int> *visited = nullptr,
+    int root = 0) // Subtree to start from, packets hand diverged rays over here
+{
+    const vector<Sphere> &spheres = scene.spheres;
+    bool hit_any = false;
+    if (visited) visited->push_back(root);
+    if (!ray_intersect_aabb(ray, nodes[root].box, 0.0001f, best_dist)) return false;
+
+    // Child boxes are tested from the parent, near child is descended into while
+    // the far one waits on the stack with its entry distance
+    int stack[BVH_MAX_DEPTH];
+    float stack_t[BVH_MAX_DEPTH];
+    int sp = 0;
+    int node_idx = root;
+
+    while (true) {
+        const BVHNode &node = nodes[node_idx];
+
+        if (node.count < 0) { // Lazy stub
+            const LazyBVHSubtree &sub = ensure_lazy_subtree(scene, node.start);
+            hit_any |= bvh_closest_hit(orig, dir, ray, scene, sub.nodes, sub.order, best_dist, best_sphere, visited);
+        } else if (node.count > 0) {
+            for (int i = 0; i < node.count; ++i) {
+                int sphere_idx = ordered_indices[node.start + i];
+                float t;
+                if (spheres[sphere_idx].ray_intersect(orig, dir, t) && t < best_dist) {
+                    best_dist = t;
+                    best_sphere = sphere_idx;
+                    hit_any = true;
+                }
+            }
+        } else {
+            float t_left = 0.f, t_right = 0.f;
+            bool hit_left = false, hit_right = false;
+            if (node.left >= 0) {
+                if (visited) visited->push_back(node.left);
+                hit_left = ray_intersect_aabb(ray, nodes[node.left].box, 0.0001f, best_dist, &t_left);
+            }
+            if (node.right >= 0) {
+                if (visited) visited->push_back(node.right);
+                hit_right = ray_intersect_aabb(ray, nodes[node.right].box, 0.0001f, best_dist, &t_right);
+            }
+            if (hit_left && hit_right) {
+                bool left_near = t_left <= t_right;
+                stack[sp] = left_near ? node.right : node.left;
+                stack_t[sp++] = left_near ? t_right : t_left;
+                node_idx = left_near ? node.left : node.right;
+                continue;
+            }
+            if (hit_left) { node_idx = node.left; continue; }
+            if (hit_right) { node_idx = node.right; continue; }
+        }
+
+        // Pop, skipping subtrees that start beyond the current best hit
+        do {
+            if (sp == 0) return hit_any;
+            --sp;
+        } while (stack_t[sp] > best_dist);
+        node_idx = stack[sp];
+    }
+}
+
+bool bvh_scene_intersect(
+    const Vec3f &orig,
+    const Vec3f &dir,
+    const Scene &scene,
+    Vec3f &hit,
+    Vec3f &N,
+    Material &material,
+    vector<int> *visited = nullptr) // Optional log of fetched nodes for analysis
+{
+    if (scene.scene_bvh.empty()) return false;
+    float best_dist = numeric_limits<float>::max();
+    int best_sphere = -1;
+    if (!bvh_closest_hit(orig, dir, RayPrecomp(orig, dir), scene, scene.scene_bvh, scene.bvh_order, best_dist, best_sphere, visited)) return false;
+    make_hit_record(orig, dir, scene.spheres[best_sphere], best_dist, hit, N, material);
+    return true;
+}
+
+// Primary ray packet over the binary layout, each ray's closest (t, sphere) lands in the packet
+void init_ray_packet(RayPacket &p) {
+    for (int a = 0; a < 3; ++a) { p.inv_lo[a] = numeric_limits<float>::infinity(); p.inv_hi[a] = -numeric_limits<float>::infinity(); }
+    for (int r = 0; r < p.count; ++r) {
+        p.ix[r] = safe_inverse(p.dx[r]); p.iy[r] = safe_inverse(p.dy[r]); p.iz[r] = safe_inverse(p.dz[r]);
+        p.t[r] = numeric_limits<float>::max();
+        p.sphere[r] = -1;
+        const float inv[3] = {p.ix[r], p.iy[r], p.iz[r]};
+        for (int a = 0; a < 3; ++a) { p.inv_lo[a] = min(p.inv_lo[a], inv[a]); p.inv_hi[a] = max(p.inv_hi[a], inv[a]); }
+    }
+}
+
+// Conservative frustum test: slab distances over the whole inverse direction interval.
+// Axes where the packet straddles a sign change give no bound and are skipped
+bool packet_may_hit(const RayPacket &p, const AABB &b, float t_max) {
+    float t_lo = 0.0001f, t_hi = t_max;
+    for (int a = 0; a < 3; ++a) {
+        if (p.inv_lo[a] < 0.f && p.inv_hi[a] > 0.f) continue;
+        float n0 = b.minim[a] - p.orig[a], n1 = b.maxim[a] - p.orig[a];
+        float c0 = n0 * p.inv_lo[a], c1 = n0 * p.inv_hi[a], c2 = n1 * p.inv_lo[a], c3 = n1 * p.inv_hi[a];
+        t_lo = max(t_lo, min(min(c0, c1), min(c2, c3)));
+        t_hi = min(t_hi, max(max(c0, c1), max(c2, c3)));
+    }
+    return t_lo <= t_hi;
+}
+
+// Per-ray slab test over the packet, written branch-free so it vectorizes
+int packet_hit_rays(const RayPacket &p, const AABB &b, unsigned char *active) {
+    const float ox = p.orig.x, oy = p.orig.y, oz = p.orig.z;
+    const int count = p.count; // Local copy, active may alias the packet
+    int n = 0;
+    for (int r = 0; r < count; ++r) {
+        float tx0 = (b.minim.x - ox) * p.ix[r], tx1 = (b.maxim.x - ox) * p.ix[r];
+        float ty0 = (b.minim.y - oy) * p.iy[r], ty1 = (b.maxim.y - oy) * p.iy[r];
+        float tz0 = (b.minim.z - oz) * p.iz[r], tz1 = (b.maxim.z - oz) * p.iz[r];
+        float t0 = max(max(min(tx0, tx1), min(ty0, ty1)), max(min(tz0, tz1), 0.0001f));
+        float t1 = min(min(max(tx0, tx1), max(ty0, ty1)), min(max(tz0, tz1), p.t[r]));
+        active[r] = t0 < t1;
+        n += active[r];
+    }
+    return n;
+}
+
+// Sphere::ray_intersect across the packet, same arithmetic order so results match single rays
+void packet_intersect_sphere(RayPacket &p, const Sphere &sphere, int sphere_idx, const unsigned char *active) {
+    const Vec3f L = sphere.center - p.orig;
+    const float LL = L*L;
+    const float r2 = sphere.radius*sphere.radius;
+    const int count = p.count;
+    for (int r = 0; r < count; ++r) {
+        float projection = L.z*p.dz[r] + L.y*p.dy[r] + L.x*p.dx[r];
+        float d2 = LL - projection*projection;
+        float half_chord = sqrtf(max(r2 - d2, 0.f));
+        float t0 = projection - half_chord;
+        float t1 = projection + half_chord;
+        float t = t0 < 0 ? t1 : t0;
+        bool hit = active[r] && d2 <= r2 && t >= 0 && t < p.t[r];
+        p.t[r] = hit ? t : p.t[r];
+        p.sphere[r] = hit ? sphere_idx : p.sphere[r];
+    }
+}
+
+// Traversal starts from roots (the tree root, or a tile's candidate subtrees), first one on top
+void packet_closest_hit(RayPacket &p, const Scene &scene, const vector<int> &roots) {
+    const vector<BVHNode> &nodes = scene.scene_bvh;
+    const vector<Sphere> &spheres = scene.spheres;
+    if (nodes.empty()) return;
+
+    float packet_t = numeric_limits<float>::max(); // Farthest best hit in the packet
+    unsigned char active[PACKET_RAYS];
+    int stack[BVH_MAX_DEPTH + TILE_MAX_CANDIDATES];
+    int sp = 0;
+    for (int k = (int)roots.size() - 1; k >= 0; --k) stack[sp++] = roots[k];
+
+    while (sp > 0) {
+        int node_idx = stack[--sp];
+        const BVHNode &node = nodes[node_idx];
+        if (!packet_may_hit(p, node.box, packet_t)) continue;
+        int n_active = packet_hit_rays(p, node.box, active);
+        if (n_active == 0) continue;
+
+        if (node.count < 0 || (node.count == 0 && n_active < PACKET_MIN_ACTIVE)) {
+            // Lazy stub or diverged packet, finish this subtree ray by ray
+            for (int r = 0; r < p.count; ++r) {
+                if (!active[r]) continue;
+                Vec3f dir(p.dx[r], p.dy[r], p.dz[r]);
+                bvh_closest_hit(p.orig, dir, RayPrecomp(p.orig, dir), scene, nodes, scene.bvh_order, p.t[r], p.sphere[r], nullptr, node_idx);
+            }
+        } else if (node.count > 0) {
+            for (int i = 0; i < node.count; ++i) {
+                int sphere_idx = scene.bvh_order[node.start + i];
+                packet_intersect_sphere(p, spheres[sphere_idx], sphere_idx, active);
+            }
+        } else {
+            // Near child first, by the first active ray's direction along the axis separating the children
+            const AABB &lb = nodes[node.left].box, &rb = nodes[node.right].box;
+            Vec3f sep = (rb.minim + rb.maxim) - (lb.minim + lb.maxim);
+            int axis = fabsf(sep.x) > fabsf(sep.y) ? (fabsf(sep.x) > fabsf(sep.z) ? 0 : 2) : (fabsf(sep.y) > fabsf(sep.z) ? 1 : 2);
+            int first = 0;
+            while (!active[first]) ++first;
+            const float d[3] = {p.dx[first], p.dy[first], p.dz[first]};
+            bool left_near = (d[axis] * sep[axis]) >= 0.f;
+            stack[sp++] = left_near ? node.right : node.left;
+            stack[sp++] = left_near ? node.left : node.right;
+            continue;
+        }
+
+        packet_t = 0.f;
+        for (int r = 0; r < p.count; ++r) packet_t = max(packet_t, p.t[r]);
+    }
+}
+
+// Side planes of the tile frustum through the camera origin, from the tile's corner directions
+// in winding order, plus the plane z = 0 so boxes behind the camera are dropped. Normals point inwards
+TileFrustum make_tile_frustum(const Vec3f (&corner)[4]) {
+    TileFrustum f;
+    Vec3f center = corner[0] + corner[1] + corner[2] + corner[3];
+    for (int k = 0; k < 4; ++k) {
+        Vec3f n = cross(corner[k], corner[(k + 1) % 4]);
+        f.normal[k] = n * center < 0 ? -n : n;
+    }
+    f.normal[4] = Vec3f(0, 0, -1);
+    return f;
+}
+
+// Conservative box test, a box is culled only when it lies fully outside one plane
+bool frustum_overlaps(const TileFrustum &f, const AABB &b) {
+    for (int k = 0; k < 5; ++k) {
+        const Vec3f &n = f.normal[k];
+        Vec3f p(n.x > 0 ? b.maxim.x : b.minim.x, n.y > 0 ? b.maxim.y : b.minim.y, n.z > 0 ? b.maxim.z : b.minim.z);
+        if (n * p < 0.f) return false;
+    }
+    return true;
+}
+
+// Subtrees covering everything visible through the frustum. Starting from the root, visible nodes are
+// replaced by their visible children while the list stays within TILE_MAX_CANDIDATES, so chains with a
+// single visible child collapse for free. Sorted near to far by box distance from the camera
+void tile_candidates(const Scene &scene, const TileFrustum &f, vector<int> &out) {
+    const vector<BVHNode> &nodes = scene.scene_bvh;
+    out.clear();
+    if (nodes.empty() || !frustum_overlaps(f, nodes[0].box)) return;
+    out.push_back(0);
+
+    bool refined = true;
+    while (refined) {
+        refined = false;
+        for (size_t k = 0; k < out.size(); ++k) {
+            const BVHNode &node = nodes[out[k]];
+            if (node.count != 0) continue; // Leaf or lazy stub
+            bool left = frustum_overlaps(f, nodes[node.left].box);
+            bool right = frustum_overlaps(f, nodes[node.right].box);
+            if (left && right && out.size() >= (size_t)TILE_MAX_CANDIDATES) continue;
+            int first = left ? node.left : node.right;
+            if (!left && !right) out.erase(out.begin() + k--);
+            else {
+                out[k--] = first;
+                if (left && right) out.push_back(node.right);
+            }
+            refined = true;
+        }
+    }
+
+    auto distance = [&](int idx) {
+        const AABB &b = nodes[idx].box;
+        Vec3f closest(clamp(0.f, b.minim.x, b.maxim.x), clamp(0.f, b.minim.y, b.maxim.y), clamp(0.f, b.minim.z, b.maxim.z));
+        return closest.norm();
+    };
+    sort(out.begin(), out.end(), [&](int a, int b) { return distance(a) < distance(b); });
+}
+
+// Any-hit query, stops at the first sphere hit closer than t_max and returns it (-1 if none)
+int bvh_occluded(
+    const Vec3f &orig,
+    const Vec3f &dir,
+    const RayPrecomp &ray,
+    const Scene &scene,
+    const vector<BVHNode> &nodes,
+    const vector<int> &ordered_indices,
+    float t_max,
+    vector<int> *visited = nullptr) // Optional log of fetched nodes for analysis
+{
+    const vector<Sphere> &spheres = scene.spheres;
+    int stack[BVH_MAX_DEPTH];
+    int sp = 0;
+    stack[sp++] = 0; // Root
+
+    while (sp > 0) {
+        if (visited) visited->push_back(stack[sp - 1]);
+        const BVHNode &node = nodes[stack[--sp]];
+        if (!ray_intersect_aabb(ray, node.box, 0.0001f, t_max)) continue;
+
+        if (node.count < 0) { // Lazy stub
+            const LazyBVHSubtree &sub = ensure_lazy_subtree(scene, node.start);
+            int occluder = bvh_occluded(orig, dir, ray, scene, sub.nodes, sub.order, t_max, visited);
+            if (occluder >= 0) return occluder;
+        } else if (node.count > 0) {
+            for (int i = 0; i < node.count; ++i) {
+                float t;
+                int sphere_idx = ordered_indices[node.start + i];
+                if (spheres[sphere_idx].ray_intersect(orig, dir, t) && t < t_max) return sphere_idx;
+            }
+        } else {
+            if (node.right >= 0) stack[sp++] = node.right;
+            if (node.left >= 0)  stack[sp++] = node.left;
+        }
+    }
+    return -1;
+}
+
+// Stackless closest hit over scene_bvh: a hit inner node continues to its left child,
+// anything else follows the skip link. The whole traversal state is (node, best_dist, best_sphere)
+bool bvh_stackless_closest_hit(
+    const Vec3f &orig,
+    const Vec3f &dir,
+    const RayPrecomp &ray,
+    const Scene &scene,
+    const vector<BVHNode> &nodes,
+    const vector<int> &ordered_indices,
+    float &best_dist,
+    int &best_sphere)
+{
+    const vector<Sphere> &spheres = scene.spheres;
+    bool hit_any = false;
+    int node_idx = 0; // Root
+    while (node_idx >= 0) {
+        const BVHNode &node = nodes[node_idx];
+        if (!ray_intersect_aabb(ray, node.box, 0.0001f, best_dist)) { node_idx = node.skip; continue; }
+
+        if (node.count < 0) { // Lazy stub
+            const LazyBVHSubtree &sub = ensure_lazy_subtree(scene, node.start);
+            hit_any |= bvh_stackless_closest_hit(orig, dir, ray, scene, sub.nodes, sub.order, best_dist, best_sphere);
+        } else if (node.count > 0) {
+            for (int i = 0; i < node.count; ++i) {
+                int sphere_idx = ordered_indices[node.start + i];
+                float t;
+                if (spheres[sphere_idx].ray_intersect(orig, dir, t) && t < best_dist) {
+                    best_dist = t;
+                    best_sphere = sphere_idx;
+                    hit_any = true;
+                }
+            }
+        } else {
+            node_idx = node.left;
+            continue;
+        }
+        node_idx = node.skip;
+    }
+    return hit_any;
+}
+
+int bvh_stackless_occluded(
+    const Vec3f &orig,
+    const Vec3f &dir,
+    const RayPrecomp &ray,
+    const Scene &scene,
+    const vector<BVHNode> &nodes,
+    const vector<int> &ordered_indices,
+    float t_max)
+{
+    const vector<Sphere> &spheres = scene.spheres;
+    int node_idx = 0; // Root
+    while (node_idx >= 0) {
+        const BVHNode &node = nodes[node_idx];
+        if (!ray_intersect_aabb(ray, node.box, 0.0001f, t_max)) { node_idx = node.skip; continue; }
+
+        if (node.count < 0) { // Lazy stub
+            const LazyBVHSubtree &sub = ensure_lazy_subtree(scene, node.start);
+            int occluder = bvh_stackless_occluded(orig, dir, ray, scene, sub.nodes, sub.order, t_max);
+            if (occluder >= 0) return occluder;
+        } else if (node.count > 0) {
+            for (int i = 0; i < node.count; ++i) {
+                float t;
+                int sphere_idx = ordered_indices[node.start + i];
+                if (spheres[sphere_idx].ray_intersect(orig, dir, t) && t < t_max) return sphere_idx;
+            }
+        } else {
+            node_idx = node.left;
+            continue;
+        }
+        node_idx = node.skip;
+    }
+    return -1;
+}
+
+bool bvh_compact_intersect(
+    const Vec3f &orig,
+    const Vec3f &dir,
+    const vector<Sphere> &spheres,
+    const vector<BVHCompactNode> &nodes,
+    const vector<int> &ordered_indices,
+    float &best_dist,
+    int &best_sphere)
+{
+    if (nodes.empty()) return false;
+    const RayPrecomp ray(orig, dir);
+
+    int stack[BVH_MAX_DEPTH];
+    int sp = 0;
+    int node_idx = 0; // Root
+
+    while (true) {
+        const BVHCompactNode &node = nodes[node_idx];
+
+        float t_min = 0.0001f, t_max = best_dist;
+        for (int a = 0; a < 3; ++a) {
+            float t0 = slab_t(node.minim[a], ray.invdir[a], ray.org_invdir[a]);
+            float t1 = slab_t(node.maxim[a], ray.invdir[a], ray.org_invdir[a]);
+            t_min = max(t_min, min(t0, t1));
+            t_max = min(t_max, max(t0, t1));
+        }
+
+        if (t_min <= t_max) {
+            int count = node.count();
+            if (count == 0) {
+                // Near child first along the split axis, far one waits on the stack
+                if (ray.sign[node.axis()]) { stack[sp++] = node_idx + 1; node_idx = node.offset; }
+                else { stack[sp++] = node.offset; node_idx = node_idx + 1; }
+                continue;
+            }
+            for (int i = 0; i < count; ++i) {
+                int sphere_idx = ordered_indices[node.offset + i];
+                float t;
+                if (spheres[sphere_idx].ray_intersect(orig, dir, t) && t < best_dist) {
+                    best_dist = t;
+                    best_sphere = sphere_idx;
+                }
+            }
+        }
+        if (sp == 0) break;
+        node_idx = stack[--sp];
+    }
+
+    return best_sphere >= 0;
+}
+
+// Slab test of all W children at once, returns hit mask and entry distances
+template <int W>
+int intersect_children(const float (&b)[6][W], const RayPrecomp &ray, float t_min, float t_max, float *t_near) {
+    int mask = 0;
+    for (int i = 0; i < W; ++i) {
+        float tx0 = slab_t(b[0][i], ray.invdir.x, ray.org_invdir.x), tx1 = slab_t(b[3][i], ray.invdir.x, ray.org_invdir.x);
+        float ty0 = slab_t(b[1][i], ray.invdir.y, ray.org_invdir.y), ty1 = slab_t(b[4][i], ray.invdir.y, ray.org_invdir.y);
+        float tz0 = slab_t(b[2][i], ray.invdir.z, ray.org_invdir.z), tz1 = slab_t(b[5][i], ray.invdir.z, ray.org_invdir.z);
+        float t0 = max(max(min(tx0, tx1), min(ty0, ty1)), max(min(tz0, tz1), t_min));
+        float t1 = min(min(max(tx0, tx1), max(ty0, ty1)), min(max(tz0, tz1), t_max));
+        t_near[i] = t0;
+        if (t0 <= t1) mask |= 1 << i;
+    }
+    return mask;
+}
+
+#ifdef __SSE__
+__m128 slab_t(__m128 plane, __m128 invdir, __m128 org_invdir) {
+#ifdef __FMA__
+    return _mm_fmsub_ps(plane, invdir, org_invdir);
+#else
+    return _mm_sub_ps(_mm_mul_ps(plane, invdir), org_invdir);
+#endif
+}
+
+template <>
+int intersect_children<4>(const float (&b)[6][4], const RayPrecomp &ray, float t_min, float t_max, float *t_near) {
+    const __m128 ix = _mm_set1_ps(ray.invdir.x), iy = _mm_set1_ps(ray.invdir.y), iz = _mm_set1_ps(ray.invdir.z);
+    const __m128 ox = _mm_set1_ps(ray.org_invdir.x), oy = _mm_set1_ps(ray.org_invdir.y), oz = _mm_set1_ps(ray.org_invdir.z);
+    __m128 tx0 = slab_t(_mm_load_ps(b[0]), ix, ox), tx1 = slab_t(_mm_load_ps(b[3]), ix, ox);
+    __m128 ty0 = slab_t(_mm_load_ps(b[1]), iy, oy), ty1 = slab_t(_mm_load_ps(b[4]), iy, oy);
+    __m128 tz0 = slab_t(_mm_load_ps(b[2]), iz, oz), tz1 = slab_t(_mm_load_ps(b[5]), iz, oz);
+    __m128 t0 = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_set1_ps(t_min)));
+    __m128 t1 = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_set1_ps(t_max)));
+    _mm_storeu_ps(t_near, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+#endif
+
+#ifdef __AVX__
+__m256 slab_t(__m256 plane, __m256 invdir, __m256 org_invdir) {
+#ifdef __FMA__
+    return _mm256_fmsub_ps(plane, invdir, org_invdir);
+#else
+    return _mm256_sub_ps(_mm256_mul_ps(plane, invdir), org_invdir);
+#endif
+}
+
+template <>
+int intersect_children<8>(const float (&b)[6][8], const RayPrecomp &ray, float t_min, float t_max, float *t_near) {
+    const __m256 ix = _mm256_set1_ps(ray.invdir.x), iy = _mm256_set1_ps(ray.invdir.y), iz = _mm256_set1_ps(ray.invdir.z);
+    const __m256 ox = _mm256_set1_ps(ray.org_invdir.x), oy = _mm256_set1_ps(ray.org_invdir.y), oz = _mm256_set1_ps(ray.org_invdir.z);
+    __m256 tx0 = slab_t(_mm256_load_ps(b[0]), ix, ox), tx1 = slab_t(_mm256_load_ps(b[3]), ix, ox);
+    __m256 ty0 = slab_t(_mm256_load_ps(b[1]), iy, oy), ty1 = slab_t(_mm256_load_ps(b[4]), iy, oy);
+    __m256 tz0 = slab_t(_mm256_load_ps(b[2]), iz, oz), tz1 = slab_t(_mm256_load_ps(b[5]), iz, oz);
+    __m256 t0 = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)), _mm256_max_ps(_mm256_min_ps(tz0, tz1), _mm256_set1_ps(t_min)));
+    __m256 t1 = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)), _mm256_min_ps(_mm256_max_ps(tz0, tz1), _mm256_set1_ps(t_max)));
+    _mm256_storeu_ps(t_near, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif
+
+template <int W>
+int intersect_node(const BVHWideNode<W> &n, const RayPrecomp &ray, float t_min, float t_max, float *t_near) {
+    return intersect_children(n.bounds, ray, t_min, t_max, t_near) & ((1 << n.num_children) - 1);
+}
+
+int intersect_node(const BVHQuantNode &n, const RayPrecomp &ray, float t_min, float t_max, float *t_near) {
+    // Decode child bounds, empty slots are masked off below
+    alignas(16) float b[6][4];
+    for (int a = 0; a < 3; ++a) {
+        float scale = exp2_int(n.exponent[a]);
+        for (int i = 0; i < 4; ++i) {
+            b[a][i] = dequantize(n.origin[a], n.qlo[a][i], scale);
+            b[a + 3][i] = dequantize(n.origin[a], n.qhi[a][i], scale);
+        }
+    }
+    return intersect_children(b, ray, t_min, t_max, t_near) & ((1 << n.num_children) - 1);
+}
+
+template <typename Node>
+bool bvh_wide_intersect(
+    const Vec3f &orig,
+    const Vec3f &dir,
+    const vector<Sphere> &spheres,
+    const vector<Node> &nodes,
+    const vector<int> &ordered_indices,
+    float &best_dist,
+    int &best_sphere)
+{
+    if (nodes.empty()) return false;
+    const RayPrecomp ray(orig, dir);
+    const int W = Node::width;
+
+    // Stack of node idx + entry distance, far children below near ones
+    int stack[BVH_MAX_DEPTH * W];
+    float stack_t[BVH_MAX_DEPTH * W];
+    int sp = 0;
+    stack[sp] = 0; stack_t[sp++] = 0.f; // Root
+
+    while (sp > 0) {
+        --sp;
+        if (stack_t[sp] > best_dist) continue;
+        const Node &node = nodes[stack[sp]];
+
+        float t_near[W];
+        int mask = intersect_node(node, ray, 0.0001f, best_dist, t_near);
+
+        // Sort hit children near to far
+        int order[W];
+        int n = 0;
+        for (int i = 0; i < W; ++i) {
+            if (!(mask & (1 << i))) continue;
+            int j = n++;
+            while (j > 0 && t_near[order[j-1]] > t_near[i]) { order[j] = order[j-1]; --j; }
+            order[j] = i;
+        }
+
+        // Leaves first, nearest first, so best_dist shrinks before pushing
+        for (int k = 0; k < n; ++k) {
+            int i = order[k];
+            if (node.count[i] == 0 || t_near[i] > best_dist) continue;
+            for (int p = 0; p < node.count[i]; ++p) {
+                int sphere_idx = ordered_indices[node.child[i] + p];
+                float t;
+                if (spheres[sphere_idx].ray_intersect(orig, dir, t) && t < best_dist) {
+                    best_dist = t;
+                    best_sphere = sphere_idx;
+                }
+            }
+        }
+        for (int k = n - 1; k >= 0; --k) {
+            int i = order[k];
+            if (node.count[i] > 0 || t_near[i] > best_dist) continue;
+            stack[sp] = node.child[i]; stack_t[sp++] = t_near[i];
+        }
+    }
+
+    return best_sphere >= 0;
+}
+
+int bvh_compact_occluded(
+    const Vec3f &orig,
+    const Vec3f &dir,
+    const vector<Sphere> &spheres,
+    const vector<BVHCompactNode> &nodes,
+    const vector<int> &ordered_indices,
+    float t_max)
+{
+    if (nodes.empty()) return -1;
+    const RayPrecomp ray(orig, dir);
+
+    int stack[BVH_MAX_DEPTH];
+    int sp = 0;
+    int node_idx = 0; // Root
+
+    while (true) {
+        const BVHCompactNode &node = nodes[node_idx];
+
+        float t0_max = 0.0001f, t1_min = t_max;
+        for (int a = 0; a < 3; ++a) {
+            float t0 = slab_t(node.minim[a], ray.invdir[a], ray.org_invdir[a]);
+            float t1 = slab_t(node.maxim[a], ray.invdir[a], ray.org_invdir[a]);
+            t0_max = max(t0_max, min(t0, t1));
+            t1_min = min(t1_min, max(t0, t1));
+        }
+
+        if (t0_max <= t1_min) {
+            int count = node.count();
+            if (count == 0) {
+                stack[sp++] = node.offset;
+                node_idx = node_idx + 1;
+                continue;
+            }
+            for (int i = 0; i < count; ++i) {
+                float t;
+                int sphere_idx = ordered_indices[node.offset + i];
+                if (spheres[sphere_idx].ray_intersect(orig, dir, t) && t < t_max) return sphere_idx;
+            }
+        }
+        if (sp == 0) break;
+        node_idx = stack[--sp];
+    }
+    return -1;
+}
+
+template <typename Node>
+int bvh_wide_occluded(
+    const Vec3f &orig,
+    const Vec3f &dir,
+    const vector<Sphere> &spheres,
+    const vector<Node> &nodes,
+    const vector<int> &ordered_indices,
+    float t_max)
+{
+    if (nodes.empty()) return -1;
+    const RayPrecomp ray(orig, dir);
+    const int W = Node::width;
+
+    // No ordering needed, any blocker ends the query
+    int stack[BVH_MAX_DEPTH * W];
+    int sp = 0;
+    stack[sp++] = 0; // Root
+
+    while (sp > 0) {
+        const Node &node = nodes[stack[--sp]];
+        float t_near[W];
+        int mask = intersect_node(node, ray, 0.0001f, t_max, t_near);
+        for (int i = 0; i < W; ++i) {
+            if (!(mask & (1 << i))) continue;
+            if (node.count[i] == 0) { stack[sp++] = node.child[i]; continue; }
+            for (int p = 0; p < node.count[i]; ++p) {
+                float t;
+                int sphere_idx = ordered_indices[node.child[i] + p];
+                if (spheres[sphere_idx].ray_intersect(orig, dir, t) && t < t_max) return sphere_idx;
+            }
+        }
+    }
+    return -1;
+}
+
+// Any sphere hit along dir closer than t_max, -1 if none
+int find_occluder(const Vec3f &orig, const Vec3f &dir, float t_max, const Scene &scene) {
+    switch (scene.settings.bvh_layout) {
+        case BVH_LAYOUT_COMPACT: return bvh_compact_occluded(orig, dir, scene.spheres, scene.scene_bvh_compact, scene.bvh_order, t_max);
+        case BVH_LAYOUT_WIDE4: return bvh_wide_occluded(orig, dir, scene.spheres, scene.scene_bvh4, scene.bvh_order, t_max);
+        case BVH_LAYOUT_WIDE8: return bvh_wide_occluded(orig, dir, scene.spheres, scene.scene_bvh8, scene.bvh_order, t_max);
+        case BVH_LAYOUT_QUANTIZED: return bvh_wide_occluded(orig, dir, scene.spheres, scene.scene_bvh_quant, scene.bvh_order, t_max);
+        case BVH_LAYOUT_STACKLESS:
+            if (scene.scene_bvh.empty()) return -1;
+            return bvh_stackless_occluded(orig, dir, RayPrecomp(orig, dir), scene, scene.scene_bvh, scene.bvh_order, t_max);
+        default:
+            if (scene.scene_bvh.empty()) return -1;
+            return bvh_occluded(orig, dir, RayPrecomp(orig, dir), scene, scene.scene_bvh, scene.bvh_order, t_max);
+    }
+}
+
+// Shadow query: is anything hit along dir closer than t_max
+bool occluded(const Vec3f &orig, const Vec3f &dir, float t_max, const Scene &scene) {
+    return find_occluder(orig, dir, t_max, scene) >= 0;
+}
+
+// Cube face and texel of a direction from the light: the major axis picks the face, the other
+// two axes (in cyclic order) divided by it give the face coordinates in [-1, 1]
+size_t shadow_map_texel(const Vec3f &d, int res) {
+    int a = fabsf(d.x) > fabsf(d.y) && fabsf(d.x) > fabsf(d.z) ? 0 : (fabsf(d.y) > fabsf(d.z) ? 1 : 2);
+    int face = a * 2 + (d[a] < 0);
+    float inv = 1.f / fabsf(d[a]);
+    int u = min(res - 1, max(0, int((d[(a + 1) % 3] * inv * 0.5f + 0.5f) * res)));
+    int v = min(res - 1, max(0, int((d[(a + 2) % 3] * inv * 0.5f + 0.5f) * res)));
+    return ((size_t)face * res + v) * res + u;
+}
+
+// Shadow-map visibility, occluded when the light saw something closer than the point by more
+// than the bias (in texels at the point's distance)
+bool shadow_map_occluded(const ShadowCubeMap &map, const Vec3f &dir, float t_max, const RenderSettings &settings) {
+    float depth = map.depth[shadow_map_texel(-dir, map.res)];
+    float bias = t_max * 2.f / map.res * settings.shadow_map_bias;
+    return depth < t_max - bias;
+}
+
+thread_local ShadowOccluderCache shadow_cache;
+
+// Shadow test towards one light, trying the sphere that last blocked that light on this thread before the BVH
+bool shadow_occluded(const Vec3f &orig, const Vec3f &dir, float t_max, const Scene &scene, size_t light) {
+    if (light < scene.shadow_maps.size()) return shadow_map_occluded(scene.shadow_maps[light], dir, t_max, scene.settings);
+    if (!scene.settings.shadow_cache) return occluded(orig, dir, t_max, scene);
+    ShadowOccluderCache &cache = shadow_cache;
+    if (cache.last.size() < scene.lights.size()) cache.last.resize(scene.lights.size(), -1);
+    cache.tests++;
+
+    int last = cache.last[light];
+    float t;
+    if (last >= 0 && last < (int)scene.spheres.size() && scene.spheres[last].ray_intersect(orig, dir, t) && t < t_max) {
+        cache.hits++;
+        return true;
+    }
+    // Keep the old occluder on a miss, the next point may be behind it again
+    int occluder = find_occluder(orig, dir, t_max, scene);
+    if (occluder < 0) return false;
+    cache.last[light] = occluder;
+    return true;
+}
+
+// Closest (t, sphere) through the active layout, t and sphere start at max / -1
+bool scene_closest_hit(const Vec3f &orig, const Vec3f &dir, const Scene &scene, float &t, int &sphere) {
+    switch (scene.settings.bvh_layout) {
+        case BVH_LAYOUT_COMPACT: return bvh_compact_intersect(orig, dir, scene.spheres, scene.scene_bvh_compact, scene.bvh_order, t, sphere);
+        case BVH_LAYOUT_WIDE4: return bvh_wide_intersect(orig, dir, scene.spheres, scene.scene_bvh4, scene.bvh_order, t, sphere);
+        case BVH_LAYOUT_WIDE8: return bvh_wide_intersect(orig, dir, scene.spheres, scene.scene_bvh8, scene.bvh_order, t, sphere);
+        case BVH_LAYOUT_QUANTIZED: return bvh_wide_intersect(orig, dir, scene.spheres, scene.scene_bvh_quant, scene.bvh_order, t, sphere);
+        case BVH_LAYOUT_STACKLESS:
+            if (scene.scene_bvh.empty()) return false;
+            return bvh_stackless_closest_hit(orig, dir, RayPrecomp(orig, dir), scene, scene.scene_bvh, scene.bvh_order, t, sphere);
+        default:
+            if (scene.scene_bvh.empty()) return false;
+            return bvh_closest_hit(orig, dir, RayPrecomp(orig, dir), scene, scene.scene_bvh, scene.bvh_order, t, sphere);
+    }
+}
+
+// Distance to the first sphere per cube texel, ray cast from the light through the BVH
+void build_shadow_map(const Scene &scene, size_t light, ShadowCubeMap &map) {
+    const int res = scene.settings.shadow_map_res;
+    const Vec3f orig = scene.lights[light].position;
+    map.res = res;
+    map.position = orig;
+    map.depth.assign((size_t)6 * res * res, numeric_limits<float>::max());
+
+    #pragma omp parallel for
+    for (int row = 0; row < 6 * res; row++) {
+        const int face = row / res, v = row % res;
+        const int a = face / 2;
+        for (int u = 0; u < res; u++) {
+            Vec3f dir;
+            dir[a] = face % 2 ? -1.f : 1.f;
+            dir[(a + 1) % 3] = (u + 0.5f) * 2.f / res - 1.f;
+            dir[(a + 2) % 3] = (v + 0.5f) * 2.f / res - 1.f;
+            dir.normalize();
+            float t = numeric_limits<float>::max();
+            int sphere = -1;
+            scene_closest_hit(orig, dir, scene, t, sphere);
+            map.depth[((size_t)face * res + v) * res + u] = t;
+        }
+    }
+}
+
+bool scene_intersect(const Vec3f &orig, const Vec3f &dir, const Scene &scene, Vec3f &hit, Vec3f &N, Material &material) {
+    float t = numeric_limits<float>::max();
+    int sphere = -1;
+    if (!scene_closest_hit(orig, dir, scene, t, sphere)) return false;
+    make_hit_record(orig, dir, scene.spheres[sphere], t, hit, N, material);
+    return true;
+}
+
+// Direction vector --- See Phong's algorithm
+Vec3f reflect(const Vec3f &I, const Vec3f &N) {
+    return I - N*2.f*(I*N);
+}
+
+// Refraction formula using Snell's law --- https://en.wikipedia.org/wiki/Snell%27s_law
+Vec3f refract(const Vec3f &I, const Vec3f &N, const float &refractive_index) {
+    float cosi = - max(-1.f, min(1.f, I*N));
+    float etai = 1, etat = refractive_index;
+    Vec3f n = N;
+
+    // Swap indices if ray in object
+    if (cosi < 0) {
+        cosi = -cosi;
+        swap(etai, etat); n = -N;
+    }
+
+    float eta = etai / etat;
+    float k = 1 - eta*eta*(1 - cosi*cosi);
+    return k < 0 ? Vec3f(0,0,0) : I*eta + n*(eta * cosi - sqrtf(k));
+}
+
+// Compute background texture & pixel coords
+Vec3f background_color(const Vec3f &dir, const Scene &scene) {
+    const float inv_pi = 1/PI;
+    const float inv_maxcol = 1/255.0f;
+    float u = 0.5f + atan2f(dir.z, dir.x) * inv_pi * 0.5f;
+    float v = 0.5f - asinf(dir.y) * inv_pi;
+
+    int px = min(bg_width - 1, max(0, int(u * bg_width)));
+    int py = min(bg_height - 1, max(0, int(v * bg_height)));
+
+    int index = (py * bg_width + px) * 3;
+    float r = scene.bg_data[index] * inv_maxcol;
+    float g = scene.bg_data[index + 1] * inv_maxcol;
+    float b = scene.bg_data[index + 2] * inv_maxcol;
+    return Vec3f(r, g, b);
+}
+
+// Largest cosine between axis and a direction from p into the box, through its bounding sphere
+float max_cos_to_box(const Vec3f &p, const Vec3f &axis, const AABB &box) {
+    Vec3f v = (box.minim + box.maxim) * 0.5f - p;
+    float r = (box.maxim - box.minim).norm() * 0.5f;
+    float d = v.norm();
+    if (d <= r) return 1.f;
+    float theta = acosf(max(-1.f, min(1.f, (v*axis) / d)));
+    float half = asinf(r / d);
+    return theta <= half ? 1.f : cosf(theta - half);
+}
+
+// Whole box on or behind the tangent plane at p
+bool behind_surface(const Vec3f &p, const Vec3f &N, const AABB &box) {
+    Vec3f farthest(N.x > 0 ? box.maxim.x : box.minim.x, N.y > 0 ? box.maxim.y : box.minim.y, N.z > 0 ? box.maxim.z : box.minim.z);
+    return (farthest - p)*N <= 0.f;
+}
+
+// Lights to shade a hit with. With few lights (or cuts off) that is every light, otherwise a
+// lightcuts-style cut: from the root, the node with the largest error bound is replaced by its
+// children while that bound exceeds light_cut_error of the estimated total. Nodes entirely
+// behind the surface are dropped on the way, before any shadow ray
+void select_lights(const Vec3f &dir, const Vec3f &point, const Vec3f &N, const Material &material, const Scene &scene, vector<LightSample> &out) {
+    out.clear();
+    const RenderSettings &settings = scene.settings;
+    if (!settings.light_cuts || scene.lights.size() < (size_t)LIGHT_CUT_MIN_LIGHTS || scene.light_bvh.empty()) {
+        for (size_t i = 0; i < scene.lights.size(); ++i) out.push_back(LightSample{(int)i, scene.lights[i].intensity});
+        return;
+    }
+
+    const vector<LightNode> &nodes = scene.light_bvh;
+    const Vec3f R = reflect(dir, N); // reflect(l, N)*dir == l*reflect(dir, N)
+    const float diffuse_weight = material.albedo[0] * max(material.diffuse_color.x, max(material.diffuse_color.y, material.diffuse_color.z));
+    const float specular_weight = material.albedo[1];
+
+    thread_local vector<LightCutEntry> cut; // Max-heap on bound
+    cut.clear();
+    float total = 0;
+    auto add = [&](int node_idx) {
+        const LightNode &node = nodes[node_idx];
+        if (behind_surface(point, N, node.box)) return;
+        Vec3f l = (scene.lights[node.light].position - point).normalize();
+        float estimate = node.intensity * (max(0.f, l*N) * diffuse_weight + powf(max(0.f, l*R), material.specular_exponent) * specular_weight);
+        float bound = 0;
+        if (node.left >= 0) {
+            float cos_n = max(0.f, max_cos_to_box(point, N, node.box));
+            float cos_r = max(0.f, max_cos_to_box(point, R, node.box));
+            bound = node.intensity * (cos_n * diffuse_weight + powf(cos_r, material.specular_exponent) * specular_weight);
+        }
+        total += estimate;
+        cut.push_back(LightCutEntry{bound, estimate, node_idx});
+        push_heap(cut.begin(), cut.end());
+    };
+
+    add(0);
+    while (!cut.empty() && (int)cut.size() < settings.light_cut_max) {
+        const LightCutEntry top = cut.front();
+        if (nodes[top.node].left < 0 || top.bound <= settings.light_cut_error * total) break;
+        pop_heap(cut.begin(), cut.end());
+        cut.pop_back();
+        total -= top.estimate;
+        add(nodes[top.node].left);
+        add(nodes[top.node].right);
+    }
+    for (const LightCutEntry &e : cut) out.push_back(LightSample{nodes[e.node].light, nodes[e.node].intensity});
+}
+
+// Phong colour from the lights at a hit, shadow rays included
+Vec3f direct_light(const Vec3f &dir, const Vec3f &point, const Vec3f &N, const Material &material, const Scene &scene) {
+    float diffuse_light_intensity = 0;
+    float specular_light_intensity = 0;
+
+    thread_local vector<LightSample> samples;
+    select_lights(dir, point, N, material, scene, samples);
+    for (const LightSample &sample : samples) {
+        Vec3f to_light = scene.lights[sample.light].position - point;
+        float light_distance = to_light.norm();
+        Vec3f light_dir = to_light * (1 / light_distance);
+        if (light_dir*N <= 0.f) continue; // Facing away, would be shadowed by the sphere itself
+        
+        // Check if point in shadow of the light
+        Vec3f shadow_orig = point + N*1e-3;
+        if (shadow_occluded(shadow_orig, light_dir, light_distance, scene, sample.light))
+            continue;
+
+        diffuse_light_intensity  += sample.intensity * (light_dir*N);
+        specular_light_intensity += powf(max(0.f, reflect(light_dir, N)*dir), material.specular_exponent)*sample.intensity;
+    }
+
+    // See https://en.wikipedia.org/wiki/Phong_reflection_model#Concepts
+    return material.diffuse_color * diffuse_light_intensity * material.albedo[0] + Vec3f(1., 1., 1.)*specular_light_intensity * material.albedo[1];
+}
+
+// Unit-intensity Phong colour of one light, visibility aside
+Vec3f phong_colour(const Vec3f &dir, const Vec3f &N, const Vec3f &light_dir, const Material &material) {
+    float specular = powf(max(0.f, reflect(light_dir, N)*dir), material.specular_exponent);
+    return material.diffuse_color * (light_dir*N) * material.albedo[0] + Vec3f(1., 1., 1.)*specular * material.albedo[1];
+}
+
+// Whether a light reaches the point, false when it faces away or is occluded
+bool light_visible(const Vec3f &point, const Vec3f &N, const Scene &scene, int light, Vec3f &light_dir) {
+    Vec3f to_light = scene.lights[light].position - point;
+    float light_distance = to_light.norm();
+    light_dir = to_light * (1 / light_distance);
+    if (light_dir*N <= 0.f) return false;
+    return !shadow_occluded(point + N*1e-3, light_dir, light_distance, scene, light);
+}
+
+// A secondary branch is traced only when its weight is non-zero and reaches min_contribution
+bool worth_tracing(float weight, const RenderSettings &settings) {
+    return weight != 0.f && weight >= settings.min_contribution;
+}
+
+// Queues the reflect / refract rays of a hit, weighted by the material albedo. Refraction
+// under total internal reflection (refract returns a zero vector) is dropped. Returns the
+// branches queued as a mask of (1 << BRANCH_*), parent is passed on for trace_ray_tree
+int push_secondary(PathVertex *stack, int &sp, const Vec3f &dir, const Vec3f &point, const Vec3f &N, const Material &material, float weight, int depth, const Scene &scene, int parent = -1) {
+    int queued = 0;
+    if (worth_tracing(weight * material.albedo[3], scene.settings)) {
+        Vec3f refract_dir = refract(dir, N, material.refractive_index);
+        if (refract_dir*refract_dir > 0.f) {
+            refract_dir.normalize();
+            stack[sp++] = PathVertex{refract_dir*N < 0 ? point - N*1e-3 : point + N*1e-3, refract_dir, weight * material.albedo[3], depth, parent, BRANCH_REFRACT};
+            queued |= 1 << BRANCH_REFRACT;
+        }
+    }
+    if (worth_tracing(weight * material.albedo[2], scene.settings)) {
+        Vec3f reflect_dir = reflect(dir, N).normalize();
+        stack[sp++] = PathVertex{reflect_dir*N < 0 ? point - N*1e-3 : point + N*1e-3, reflect_dir, weight * material.albedo[2], depth, parent, BRANCH_REFLECT};
+        queued |= 1 << BRANCH_REFLECT;
+    }
+    return queued;
+}
+
+// Colour at a found hit. Iterative: the secondary rays go on an explicit stack with their
+// path throughput and their light is added to one sum. Rays past max_depth see the background
+Vec3f shade_hit(const Vec3f &dir, const Vec3f &point, const Vec3f &N, const Material &material, const Scene &scene) {
+    PathVertex stack[MAX_RAY_DEPTH + 2]; // Depth-first, one pending sibling per level
+    int sp = 0;
+    Vec3f color = direct_light(dir, point, N, material, scene);
+    push_secondary(stack, sp, dir, point, N, material, 1.f, 1, scene);
+
+    while (sp > 0) {
+        const PathVertex v = stack[--sp];
+        float t = numeric_limits<float>::max();
+        int sphere = -1;
+        if (v.depth > scene.settings.max_depth || !scene_closest_hit(v.orig, v.dir, scene, t, sphere)) {
+            color = color + background_color(v.dir, scene) * v.weight;
+            continue;
+        }
+        Vec3f hit, hit_N;
+        Material hit_material;
+        make_hit_record(v.orig, v.dir, scene.spheres[sphere], t, hit, hit_N, hit_material);
+        color = color + direct_light(v.dir, hit, hit_N, hit_material, scene) * v.weight;
+        push_secondary(stack, sp, v.dir, hit, hit_N, hit_material, v.weight, v.depth + 1, scene);
+    }
+    return color;
+}
+
+Vec3f cast_ray(const Vec3f &orig, const Vec3f &dir, const Scene &scene) {
+    Vec3f point, N;
+    Material material;
+    if (!scene_intersect(orig, dir, scene, point, N, material)) return background_color(dir, scene);
+    return shade_hit(dir, point, N, material, scene);
+}
+
+// Same ray tree as cast_ray / shade_hit, but only its geometry: every hit, and every secondary
+// ray that ends in the background, is appended to records in depth-first order, with parents
+// indexed from the first record of this tree. Returns the light-independent part of the colour
+Vec3f trace_ray_tree(const Vec3f &orig, const Vec3f &dir, const Scene &scene, vector<HitRecord> &records) {
+    PathVertex stack[MAX_RAY_DEPTH + 2];
+    int sp = 0;
+    stack[sp++] = PathVertex{orig, dir, 1.f, 0};
+    Vec3f base(0, 0, 0);
+    const size_t first = records.size();
+
+    while (sp > 0) {
+        const PathVertex v = stack[--sp];
+        HitRecord record;
+        record.dir = v.dir;
+        record.weight = v.weight;
+        record.parent = v.parent;
+        record.branch = v.branch;
+        float t = numeric_limits<float>::max();
+        int sphere = -1;
+        if (v.depth > scene.settings.max_depth || !scene_closest_hit(v.orig, v.dir, scene, t, sphere)) {
+            Vec3f background = background_color(v.dir, scene);
+            base = base + background * v.weight;
+            if (v.depth == 0) continue; // Primary misses never change
+            record.point = background;
+            records.push_back(record);
+            continue;
+        }
+        Material material;
+        make_hit_record(v.orig, v.dir, scene.spheres[sphere], t, record.point, record.N, material);
+        record.sphere = sphere;
+        int idx = records.size() - first;
+        records.push_back(record);
+        records.back().queued = push_secondary(stack, sp, v.dir, record.point, record.N, material, v.weight, v.depth + 1, scene, idx);
+    }
+    return base;
+}
+
+// Trace a sparse grid of primary rays, plus one reflection ray and the any-hit shadow rays per hit,
+// through the binary traversal and hand each ray's fetched-node log to visit(log, is_primary)
+template <typename Visit>
+void sample_bvh_traversals(const Scene &scene, int cols, int rows, Visit visit) {
+    const float scale = tan(scene.FOV/2.0f);
+    const float scale_aspect_prod = scale * frame_width / float(frame_height);
+    vector<int> visited;
+    for (int j = 0; j < rows; ++j) {
+        for (int i = 0; i < cols; ++i) {
+            float x =  (2*(i + 0.5f) / cols - 1) * scale_aspect_prod;
+            float y = -(2*(j + 0.5f) / rows - 1) * scale;
+            Vec3f dir = Vec3f(x, y, -1).normalize();
+            Vec3f point, N, p2, N2;
+            Material material;
+
+            visited.clear();
+            bool hit = bvh_scene_intersect(Vec3f(0,0,0), dir, scene, point, N, material, &visited);
+            visit(visited, true);
+            if (!hit) continue;
+
+            Vec3f reflect_dir = reflect(dir, N).normalize();
+            Vec3f reflect_orig = reflect_dir*N < 0 ? point - N*1e-3 : point + N*1e-3;
+            visited.clear();
+            bvh_scene_intersect(reflect_orig, reflect_dir, scene, p2, N2, material, &visited);
+            visit(visited, false);
+
+            for (size_t l = 0; l < scene.lights.size(); ++l) {
+                Vec3f to_light = scene.lights[l].position - point;
+                float light_distance = to_light.norm();
+                Vec3f light_dir = to_light * (1 / light_distance);
+                Vec3f shadow_orig = light_dir*N < 0 ? point - N*1e-3 : point + N*1e-3;
+                visited.clear();
+                bvh_occluded(shadow_orig, light_dir, RayPrecomp(shadow_orig, light_dir), scene, scene.scene_bvh, scene.bvh_order, light_distance, &visited);
+                visit(visited, false);
+            }
+        }
+    }
+}
+
+// Expects a complete tree, see finalize_lazy_bvh.
+// Walk scene_bvh for structural quality metrics, then trace a sparse sample of
+// primary, reflection and shadow rays to estimate traversal work per ray
+BVHReport analyze_bvh(const Scene &scene, int sample_cols = 64, int sample_rows = 36) {
+    BVHReport report;
+    const vector<BVHNode> &nodes = scene.scene_bvh;
+    report.memory_bytes = bvh_memory_bytes(scene);
+    if (scene.settings.bvh_layout != BVH_LAYOUT_BINARY && scene.settings.bvh_layout != BVH_LAYOUT_STACKLESS) report.memory_bytes += nodes.size() * sizeof(BVHNode);
+    if (nodes.empty()) return report;
+
+    report.sah_cost = bvh_sah_cost(nodes, scene.settings);
+    report.node_count = (int)nodes.size();
+
+    double leaf_depth_sum = 0, overlap_sum = 0;
+    int inner_count = 0;
+    vector<pair<int, int>> stack(1, make_pair(0, 0)); // Node idx, depth
+    while (!stack.empty()) {
+        int idx = stack.back().first, depth = stack.back().second;
+        stack.pop_back();
+        const BVHNode &n = nodes[idx];
+        report.max_depth = max(report.max_depth, depth);
+
+        if (n.count > 0) {
+            report.leaf_count++;
+            leaf_depth_sum += depth;
+            if ((int)report.leaf_histogram.size() <= n.count) report.leaf_histogram.resize(n.count + 1, 0);
+            report.leaf_histogram[n.count]++;
+            continue;
+        }
+
+        // Overlap of sibling boxes relative to their parent
+        const AABB &l = nodes[n.left].box, &r = nodes[n.right].box;
+        AABB overlap;
+        overlap.minim = Vec3f(max(l.minim.x, r.minim.x), max(l.minim.y, r.minim.y), max(l.minim.z, r.minim.z));
+        overlap.maxim = Vec3f(min(l.maxim.x, r.maxim.x), min(l.maxim.y, r.maxim.y), min(l.maxim.z, r.maxim.z));
+        bool empty = overlap.minim.x > overlap.maxim.x || overlap.minim.y > overlap.maxim.y || overlap.minim.z > overlap.maxim.z;
+        float area = n.box.surface_area();
+        if (!empty && area > 0.f) overlap_sum += overlap.surface_area() / area;
+        inner_count++;
+
+        stack.push_back(make_pair(n.left, depth + 1));
+        stack.push_back(make_pair(n.right, depth + 1));
+    }
+    report.avg_leaf_depth = report.leaf_count ? float(leaf_depth_sum / report.leaf_count) : 0.f;
+    report.sibling_overlap = inner_count ? float(overlap_sum / inner_count) : 0.f;
+
+    // Sampled rays through the binary traversal
+    long long primary_visits = 0, total_visits = 0;
+    int primary_rays = 0, total_rays = 0;
+    sample_bvh_traversals(scene, sample_cols, sample_rows, [&](const vector<int> &visited, bool primary) {
+        if (primary) { primary_visits += visited.size(); primary_rays++; }
+        total_visits += visited.size();
+        total_rays++;
+    });
+    report.sampled_rays = total_rays;
+    report.primary_visits_per_ray = primary_rays ? float(primary_visits) / primary_rays : 0.f;
+    report.visits_per_ray = total_rays ? float(total_visits) / total_rays : 0.f;
+    return report;
+}
+
+// Re-lay out scene_bvh from sampled traversals so hot nodes sit right after the node that is
+// usually fetched before them. Visited nodes are chained greedily by most frequent successor,
+// hottest chain first; cold nodes follow in depth-first order. Root stays at 0.
+void reorder_bvh_by_profile(Scene &scene, int sample_cols = 128, int sample_rows = 72) {
+    finalize_lazy_bvh(scene);
+    vector<BVHNode> &nodes = scene.scene_bvh;
+    const int n = (int)nodes.size();
+    if (n < 3) return;
+
+    vector<int> visits(n, 0);
+    unordered_map<long long, int> transitions;
+    sample_bvh_traversals(scene, sample_cols, sample_rows, [&](const vector<int> &visited, bool) {
+        for (size_t k = 0; k < visited.size(); ++k) {
+            visits[visited[k]]++;
+            if (k + 1 < visited.size()) transitions[(long long)visited[k] * n + visited[k + 1]]++;
+        }
+    });
+
+    vector<int> successor(n, -1), successor_count(n, 0);
+    for (const auto &t : transitions) {
+        int from = (int)(t.first / n), to = (int)(t.first % n);
+        if (t.second > successor_count[from]) { successor_count[from] = t.second; successor[from] = to; }
+    }
+
+    vector<int> new_index(n, -1);
+    int placed = 0;
+    priority_queue<pair<int, int>> frontier; // Visit count, node idx
+    frontier.push(make_pair(visits[0], 0));
+    while (!frontier.empty()) {
+        int cur = frontier.top().second;
+        frontier.pop();
+        while (cur >= 0 && new_index[cur] < 0 && visits[cur] > 0) {
+            new_index[cur] = placed++;
+            const BVHNode &node = nodes[cur];
+            if (node.count == 0) {
+                if (visits[node.left] > 0 && new_index[node.left] < 0) frontier.push(make_pair(visits[node.left], node.left));
+                if (visits[node.right] > 0 && new_index[node.right] < 0) frontier.push(make_pair(visits[node.right], node.right));
+            }
+            cur = successor[cur];
+        }
+    }
+
+    // Cold nodes
+    vector<int> stack(1, 0);
+    while (!stack.empty()) {
+        int idx = stack.back();
+        stack.pop_back();
+        if (new_index[idx] < 0) new_index[idx] = placed++;
+        if (nodes[idx].count == 0) { stack.push_back(nodes[idx].right); stack.push_back(nodes[idx].left); }
+    }
+
+    vector<BVHNode> out(n);
+    for (int i = 0; i < n; ++i) {
+        BVHNode node = nodes[i];
+        if (node.count == 0) { node.left = new_index[node.left]; node.right = new_index[node.right]; }
+        out[new_index[i]] = node;
+    }
+    nodes.swap(out);
+    link_bvh_skips(nodes);
+}
+
+void print_bvh_report(const BVHReport &report, ostream &out) {
+    out << "BVH report\n";
+    out << "  nodes: " << report.node_count << " (" << report.leaf_count << " leaves)\n";
+    out << "  memory: " << report.memory_bytes / 1024.0 << " KB\n";
+    out << "  SAH cost: " << report.sah_cost << "\n";
+    out << "  depth: max " << report.max_depth << ", avg leaf " << report.avg_leaf_depth << "\n";
+    out << "  sibling overlap: " << report.sibling_overlap * 100.f << "% of parent area\n";
+    out << "  leaf sizes:";
+    for (size_t i = 1; i < report.leaf_histogram.size(); ++i) out << " " << i << ":" << report.leaf_histogram[i];
+    out << "\n";
+    out << "  node visits/ray: " << report.visits_per_ray << " (primary " << report.primary_visits_per_ray << ", " << report.sampled_rays << " rays sampled)\n";
+}
+
+void store_pixel(vector<unsigned char> &framebuffer, size_t idx, Vec3f c) {
+    float maxVal = max(c[0], max(c[1], c[2]));
+    if (maxVal > 1.f) c = c * (1.f / maxVal);
+
+    framebuffer[idx+0] = static_cast<unsigned char>(clamp(c[0], 0.f, 1.f) * 255.f);
+    framebuffer[idx+1] = static_cast<unsigned char>(clamp(c[1], 0.f, 1.f) * 255.f);
+    framebuffer[idx+2] = static_cast<unsigned char>(clamp(c[2], 0.f, 1.f) * 255.f);
+}
+
+// Wavefront integrator: rows are processed in chunks, each chunk's rays move through
+// batched stages (generate, extend, shade, shadow) over SoA queues. Light is accumulated
+// per pixel with the ray's throughput instead of returned up a recursion
+const int WAVEFRONT_CHUNK_ROWS = 16;
+
+// BVHNode straddles cache lines, so both ends are prefetched. The builtin also builds without SSE
+void prefetch_node(const BVHNode &node) {
+    __builtin_prefetch((const char *)&node);
+    __builtin_prefetch((const char *)&node + sizeof(BVHNode) - 1);
+}
+
+// Moves a ray onto a node and prefetches what its next turn will touch. The node itself is
+// warm, its box was just tested from the parent
+void enter_node(InterleavedRay &s, int node_idx, const vector<BVHNode> &nodes, const vector<int> &order, const vector<Sphere> &spheres) {
+    const BVHNode &node = nodes[node_idx];
+    s.node = node_idx;
+    if (node.count == 0) {
+        if (node.left >= 0) prefetch_node(nodes[node.left]);
+        if (node.right >= 0) prefetch_node(nodes[node.right]);
+        s.phase = InterleavedRay::CHILDREN;
+    } else if (node.count > 0) {
+        for (int i = 0; i < node.count; ++i) __builtin_prefetch(&spheres[order[node.start + i]]);
+        s.phase = InterleavedRay::LEAF;
+    } else {
+        s.phase = InterleavedRay::LAZY;
+    }
+}
+
+// Closest hits for the whole queue, RAY_GROUP_SIZE rays at a time (see InterleavedRay), one
+// node per ray per turn. Per ray the visit order and results match bvh_closest_hit
+void interleaved_closest_hit(RayQueue &q, const Scene &scene) {
+    const vector<BVHNode> &nodes = scene.scene_bvh;
+    const vector<int> &order = scene.bvh_order;
+    const vector<Sphere> &spheres = scene.spheres;
+    InterleavedRay group[RAY_GROUP_SIZE];
+
+    for (size_t first = 0; first < q.size(); first += RAY_GROUP_SIZE) {
+        const int count = (int)min((size_t)RAY_GROUP_SIZE, q.size() - first);
+        int active = 0;
+        for (int g = 0; g < count; ++g) {
+            const size_t r = first + g;
+            InterleavedRay &s = group[g];
+            s.orig = Vec3f(q.ox[r], q.oy[r], q.oz[r]);
+            s.dir = Vec3f(q.dx[r], q.dy[r], q.dz[r]);
+            s.ray = RayPrecomp(s.orig, s.dir);
+            s.sp = 0;
+            s.phase = InterleavedRay::DONE;
+            if (!ray_intersect_aabb(s.ray, nodes[0].box, 0.0001f, q.t[r])) continue;
+            enter_node(s, 0, nodes, order, spheres);
+            active++;
+        }
+
+        while (active > 0) {
+            for (int g = 0; g < count; ++g) {
+                InterleavedRay &s = group[g];
+                if (s.phase == InterleavedRay::DONE) continue;
+                float &best_dist = q.t[first + g];
+                int &best_sphere = q.sphere[first + g];
+                const BVHNode &node = nodes[s.node];
+
+                if (s.phase == InterleavedRay::LEAF) {
+                    for (int i = 0; i < node.count; ++i) {
+                        int sphere_idx = order[node.start + i];
+                        float t;
+                        if (spheres[sphere_idx].ray_intersect(s.orig, s.dir, t) && t < best_dist) {
+                            best_dist = t;
+                            best_sphere = sphere_idx;
+                        }
+                    }
+                } else if (s.phase == InterleavedRay::LAZY) { // Built and traversed in one go
+                    const LazyBVHSubtree &sub = ensure_lazy_subtree(scene, node.start);
+                    bvh_closest_hit(s.orig, s.dir, s.ray, scene, sub.nodes, sub.order, best_dist, best_sphere);
+                } else {
+                    float t_left = 0.f, t_right = 0.f;
+                    bool hit_left = node.left >= 0 && ray_intersect_aabb(s.ray, nodes[node.left].box, 0.0001f, best_dist, &t_left);
+                    bool hit_right = node.right >= 0 && ray_intersect_aabb(s.ray, nodes[node.right].box, 0.0001f, best_dist, &t_right);
+                    if (hit_left && hit_right) {
+                        bool left_near = t_left <= t_right;
+                        s.stack[s.sp] = left_near ? node.right : node.left;
+                        s.stack_t[s.sp++] = left_near ? t_right : t_left;
+                        enter_node(s, left_near ? node.left : node.right, nodes, order, spheres);
+                        continue;
+                    }
+                    if (hit_left) { enter_node(s, node.left, nodes, order, spheres); continue; }
+                    if (hit_right) { enter_node(s, node.right, nodes, order, spheres); continue; }
+                }
+
+                // Pop, skipping subtrees that start beyond the current best hit
+                while (s.sp > 0 && s.stack_t[s.sp - 1] > best_dist) --s.sp;
+                if (s.sp == 0) {
+                    s.phase = InterleavedRay::DONE;
+                    active--;
+                    continue;
+                }
+                --s.sp;
+                enter_node(s, s.stack[s.sp], nodes, order, spheres);
+            }
+        }
+    }
+}
+
+// Node fetches are counted on the binary layout only, and run through a small direct-mapped
+// model of the node cache so the effect of ray order on memory traffic shows up in the stats
+const int NODE_CACHE_LINES = 512;
 
-    // median split: find mid by nth_element
-    int mid = (start + end) / 2;
-    nth_element(indices.begin() + start, indices.begin() + mid, indices.begin() + end,
-        [&](int a, int b){
-            AABB ba = AABB::from_sphere(spheres[a]);
-            AABB bb = AABB::from_sphere(spheres[b]);
-            Vec3f ca = (ba.minim + ba.maxim) * 0.5f;
-            Vec3f cb = (bb.minim + bb.maxim) * 0.5f;
-            return ca[axis] < cb[axis];
-        });
-
-    bool degenerate = true;
-    {
-        AABB fa = AABB::from_sphere(spheres[indices[start]]);
-        Vec3f ca = (fa.minim + fa.maxim) * 0.5f;
-        for (int i = start+1; i < end; ++i) {
-            AABB fb = AABB::from_sphere(spheres[indices[i]]);
-            Vec3f cb = (fb.minim + fb.maxim) * 0.5f;
-            if (cb[axis] != ca[axis]) { degenerate = false; break; }
-        }
+void wavefront_extend(RayQueue &q, const Scene &scene, vector<int> &visited, vector<long long> &cache_tags, long long &fetches, long long &misses) {
+    const size_t n = q.size();
+    q.t.assign(n, numeric_limits<float>::max());
+    q.sphere.assign(n, -1);
+    if (scene.settings.bvh_layout != BVH_LAYOUT_BINARY || scene.scene_bvh.empty()) {
+        for (size_t r = 0; r < n; ++r)
+            scene_closest_hit(Vec3f(q.ox[r], q.oy[r], q.oz[r]), Vec3f(q.dx[r], q.dy[r], q.dz[r]), scene, q.t[r], q.sphere[r]);
+        return;
+    }
+    if (scene.settings.interleave_rays) { // Node fetches are not modelled here
+        interleaved_closest_hit(q, scene);
+        return;
     }
-    if (degenerate) {
-        mid = start + (count/2);
-        // Avoid inf recursion
-        sort(indices.begin()+start, indices.begin()+end);
+    for (size_t r = 0; r < n; ++r) {
+        Vec3f orig(q.ox[r], q.oy[r], q.oz[r]), dir(q.dx[r], q.dy[r], q.dz[r]);
+        visited.clear();
+        bvh_closest_hit(orig, dir, RayPrecomp(orig, dir), scene, scene.scene_bvh, scene.bvh_order, q.t[r], q.sphere[r], &visited);
+        fetches += visited.size();
+        for (int node_idx : visited) {
+            long long line = (long long)node_idx * sizeof(BVHNode) / 64;
+            long long &tag = cache_tags[line % NODE_CACHE_LINES];
+            if (tag != line) { tag = line; misses++; }
+        }
     }
+}
 
-    // Build children
-    node.left = build_bvh_recursive(nodes, ordered_indices, indices, spheres, start, mid, maxLeafSize);
-    node.right = build_bvh_recursive(nodes, ordered_indices, indices, spheres, mid, end, maxLeafSize);
-    return node_index;
+// Reorder queued rays by direction octant, then by Morton code of the origin, so
+// neighbouring rays in the queue tend to walk the same nodes
+void sort_ray_queue(RayQueue &q, RayQueue &tmp, const AABB &bounds) {
+    vector<pair<unsigned long long, int>> keyed(q.size());
+    for (size_t r = 0; r < q.size(); ++r) {
+        unsigned long long octant = (q.dx[r] < 0) | (q.dy[r] < 0) << 1 | (q.dz[r] < 0) << 2;
+        keyed[r] = make_pair(octant << 30 | morton_code(Vec3f(q.ox[r], q.oy[r], q.oz[r]), bounds), (int)r);
+    }
+    sort(keyed.begin(), keyed.end());
+    tmp.clear();
+    for (const auto &k : keyed) {
+        int r = k.second;
+        tmp.push(Vec3f(q.ox[r], q.oy[r], q.oz[r]), Vec3f(q.dx[r], q.dy[r], q.dz[r]), q.weight[r], q.pixel[r]);
+    }
+    swap(q, tmp);
 }
 
-void build_bvh(const vector<Sphere> &spheres, vector<BVHNode> &out_nodes, vector<int> &out_ordered_indices) {
-    out_nodes.clear();
-    out_ordered_indices.clear();
-    int n = (int)spheres.size();
-    if (n == 0) return;
-    vector<int> indices(n);
-    for (int i = 0; i < n; ++i) indices[i] = i;
-    build_bvh_recursive(out_nodes, out_ordered_indices, indices, spheres, 0, n, 4);
+// Misses add the background, hits queue shadow rays and the weighted reflect / refract rays
+void wavefront_shade(const RayQueue &q, RayQueue &next, ShadowQueue &shadows, vector<Vec3f> &accum, const Scene &scene) {
+    vector<LightSample> samples;
+    for (size_t r = 0; r < q.size(); ++r) {
+        Vec3f dir(q.dx[r], q.dy[r], q.dz[r]);
+        const float w = q.weight[r];
+        if (q.sphere[r] < 0) {
+            accum[q.pixel[r]] = accum[q.pixel[r]] + background_color(dir, scene) * w;
+            continue;
+        }
+        Vec3f point, N;
+        Material material;
+        make_hit_record(Vec3f(q.ox[r], q.oy[r], q.oz[r]), dir, scene.spheres[q.sphere[r]], q.t[r], point, N, material);
+
+        // Same branch pruning as push_secondary
+        if (worth_tracing(w * material.albedo[2], scene.settings)) {
+            Vec3f reflect_dir = reflect(dir, N).normalize();
+            next.push(reflect_dir*N < 0 ? point - N*1e-3 : point + N*1e-3, reflect_dir, w * material.albedo[2], q.pixel[r]);
+        }
+        Vec3f refract_dir = refract(dir, N, material.refractive_index);
+        if (worth_tracing(w * material.albedo[3], scene.settings) && refract_dir*refract_dir > 0.f) {
+            refract_dir.normalize();
+            next.push(refract_dir*N < 0 ? point - N*1e-3 : point + N*1e-3, refract_dir, w * material.albedo[3], q.pixel[r]);
+        }
+
+        select_lights(dir, point, N, material, scene, samples);
+        for (const LightSample &sample : samples) {
+            Vec3f to_light = scene.lights[sample.light].position - point;
+            float light_distance = to_light.norm();
+            Vec3f light_dir = to_light * (1 / light_distance);
+            if (light_dir*N <= 0.f) continue; // Same culling as direct_light
+            Vec3f shadow_orig = point + N*1e-3;
+
+            float diffuse = sample.intensity * (light_dir*N);
+            float specular = powf(max(0.f, reflect(light_dir, N)*dir), material.specular_exponent)*sample.intensity;
+            Vec3f c = (material.diffuse_color * diffuse * material.albedo[0] + Vec3f(1., 1., 1.)*specular * material.albedo[1]) * w;
+            if (c.x == 0.f && c.y == 0.f && c.z == 0.f) continue;
+            shadows.push(shadow_orig, light_dir, light_distance, c, q.pixel[r], sample.light);
+        }
+    }
 }
 
-bool ray_intersect_aabb(const Vec3f &orig, const Vec3f &dir, const Vec3f &invdir, const AABB &b, float t_min = 0.0001f, float t_max = numeric_limits<float>::infinity()) {
-    // Compute intersection interval for each axis
-    for (int a = 0; a < 3; ++a) {
-        float t0 = (b.minim[a] - orig[a]) * invdir[a];
-        float t1 = (b.maxim[a] - orig[a]) * invdir[a];
-        if (invdir[a] < 0.0f) swap(t0, t1);
-        t_min = t0 > t_min ? t0 : t_min;
-        t_max = t1 < t_max ? t1 : t_max;
-        if (t_max <= t_min) return false;
+void wavefront_shadow(const ShadowQueue &q, vector<Vec3f> &accum, const Scene &scene) {
+    for (size_t r = 0; r < q.size(); ++r) {
+        if (shadow_occluded(Vec3f(q.ox[r], q.oy[r], q.oz[r]), Vec3f(q.dx[r], q.dy[r], q.dz[r]), q.t_max[r], scene, q.light[r])) continue;
+        accum[q.pixel[r]] = accum[q.pixel[r]] + Vec3f(q.cr[r], q.cg[r], q.cb[r]);
     }
-    return true;
 }
 
-bool bvh_scene_intersect(
-    const Vec3f &orig,
-    const Vec3f &dir,
-    const vector<Sphere> &spheres,
-    const vector<BVHNode> &nodes,
-    const vector<int> &ordered_indices,
-    Vec3f &hit,
-    Vec3f &N,
-    Material &material)
-{
-    if (nodes.empty()) return false;
-    Vec3f invdir(1.f/dir.x, 1.f/dir.y, 1.f/dir.z);
-    float best_dist = numeric_limits<float>::max();
-    bool hit_any = false;
+vector<unsigned char> render_wavefront(const Scene &scene, RenderStats *stats = nullptr) {
+    const int width = frame_width;
+    const int height = frame_height;
+    const float scale = tan(scene.FOV/2.0f);
+    const float scale_aspect_prod = scale * frame_width / float(frame_height);
+    vector<unsigned char> framebuffer(width * height * 3);
 
-    // iterative stack
-    vector<int> stack;
-    stack.reserve(64);
-    stack.push_back(0); // Root
+    const float inv_w = (1.0/width);
+    const float inv_h = (1.0/height);
+    const int chunks = (height + WAVEFRONT_CHUNK_ROWS - 1) / WAVEFRONT_CHUNK_ROWS;
 
-    while (!stack.empty()) {
-        int node_idx = stack.back(); stack.pop_back();
-        const BVHNode &node = nodes[node_idx];
+    AABB bounds; // Origin range for the secondary-ray sort
+    for (const Sphere &sphere : scene.spheres) bounds.expand(AABB::from_sphere(sphere));
+    long long secondary_rays = 0, secondary_fetches = 0, secondary_misses = 0;
+    double sort_ms = 0, extend_ms = 0;
 
-        if (!ray_intersect_aabb(orig, dir, invdir, node.box, 0.0001f, best_dist)) continue;
+    #pragma omp parallel for schedule(dynamic)
+    for (int chunk = 0; chunk < chunks; chunk++) {
+        const int y0 = chunk * WAVEFRONT_CHUNK_ROWS;
+        const int y1 = min(y0 + WAVEFRONT_CHUNK_ROWS, height);
+        vector<Vec3f> accum((y1 - y0) * width, Vec3f(0, 0, 0));
+        RayQueue rays, next;
+        ShadowQueue shadows;
+        vector<int> visited;
+        vector<long long> cache_tags(NODE_CACHE_LINES, -1);
+        long long chunk_rays = 0, chunk_fetches = 0, chunk_misses = 0;
+        long long primary_fetches = 0, primary_misses = 0; // Warm the cache model, not reported
+        double chunk_sort_ms = 0, chunk_extend_ms = 0;
 
-        if (node.count > 0) {
-            for (int i = 0; i < node.count; ++i) {
-                int sphere_idx = ordered_indices[node.start + i];
-                float t;
-                if (spheres[sphere_idx].ray_intersect(orig, dir, t) && t < best_dist) {
-                    best_dist = t;
-                    hit = orig + dir * t;
-                    N = (hit - spheres[sphere_idx].center).normalize();
-                    material = spheres[sphere_idx].material;
-                    hit_any = true;
-                }
+        // Generate
+        for (int j = y0; j < y1; j++) {
+            for (int i = 0; i < width; i++) {
+                float x =  (2*(i + 0.5) * inv_w - 1) * scale_aspect_prod;
+                float y = -(2*(j + 0.5) * inv_h - 1) * scale;
+                rays.push(Vec3f(0,0,0), Vec3f(x, y, -1).normalize(), 1.f, (j - y0) * width + i);
             }
-        } else { // Push children
-            if (node.right >= 0) stack.push_back(node.right);
-            if (node.left >= 0)  stack.push_back(node.left);
         }
-    }
-    return hit_any;
-}
 
-// Direction vector --- See Phong's algorithm
-Vec3f reflect(const Vec3f &I, const Vec3f &N) {
-    return I - N*2.f*(I*N);
-}
+        // Same depth cutoff as shade_hit, rays past it only see the background
+        for (int depth = 0; depth <= scene.settings.max_depth && rays.size() > 0; depth++) {
+            if (depth == 0) {
+                wavefront_extend(rays, scene, visited, cache_tags, primary_fetches, primary_misses);
+            } else {
+                auto t0 = chrono::steady_clock::now();
+                if (scene.settings.sort_secondary) sort_ray_queue(rays, next, bounds);
+                auto t1 = chrono::steady_clock::now();
+                wavefront_extend(rays, scene, visited, cache_tags, chunk_fetches, chunk_misses);
+                auto t2 = chrono::steady_clock::now();
+                chunk_rays += rays.size();
+                chunk_sort_ms += chrono::duration<double, milli>(t1 - t0).count();
+                chunk_extend_ms += chrono::duration<double, milli>(t2 - t1).count();
+            }
+            next.clear();
+            shadows.clear();
+            wavefront_shade(rays, next, shadows, accum, scene);
+            wavefront_shadow(shadows, accum, scene);
+            swap(rays, next);
+        }
+        for (size_t r = 0; r < rays.size(); ++r)
+            accum[rays.pixel[r]] = accum[rays.pixel[r]] + background_color(Vec3f(rays.dx[r], rays.dy[r], rays.dz[r]), scene) * rays.weight[r];
 
-// Refraction formula using Snell's law --- https://en.wikipedia.org/wiki/Snell%27s_law
-Vec3f refract(const Vec3f &I, const Vec3f &N, const float &refractive_index) {
-    float cosi = - max(-1.f, min(1.f, I*N));
-    float etai = 1, etat = refractive_index;
-    Vec3f n = N;
+        for (int j = y0; j < y1; j++)
+            for (int i = 0; i < width; i++)
+                store_pixel(framebuffer, (i + j*width) * 3, accum[(j - y0) * width + i]);
 
-    // Swap indices if ray in object
-    if (cosi < 0) {
-        cosi = -cosi;
-        swap(etai, etat); n = -N;
+        #pragma omp critical
+        {
+            secondary_rays += chunk_rays;
+            secondary_fetches += chunk_fetches;
+            secondary_misses += chunk_misses;
+            sort_ms += chunk_sort_ms;
+            extend_ms += chunk_extend_ms;
+        }
     }
 
-    float eta = etai / etat;
-    float k = 1 - eta*eta*(1 - cosi*cosi);
-    return k < 0 ? Vec3f(0,0,0) : I*eta + n*(eta * cosi - sqrtf(k));
+    if (stats) {
+        stats->secondary_rays = secondary_rays;
+        stats->secondary_fetches = secondary_fetches;
+        stats->secondary_node_misses = secondary_misses;
+        stats->secondary_sort_ms = sort_ms;
+        stats->secondary_extend_ms = extend_ms;
+    }
+    return framebuffer;
 }
 
-Vec3f cast_ray(const Vec3f &orig, const Vec3f &dir, const Scene &scene, size_t depth=0) {
-    Vec3f point, N;
-    Material material;
-    const float inv_pi = 1/PI;
-    const float inv_maxcol = 1/255.0f;
+vector<unsigned char> render(const Scene &scene, RenderStats *stats = nullptr) {
+    if (scene.settings.integrator == INTEGRATOR_WAVEFRONT) return render_wavefront(scene, stats);
+    const int width = frame_width;
+    const int height = frame_height;
+    const float scale = tan(scene.FOV/2.0f);
+    const float scale_aspect_prod = scale * frame_width / float(frame_height);
+    vector<unsigned char> framebuffer(width * height * 3);
 
-    // Compute background texture & pixel coords
-    if (depth > 4 || !bvh_scene_intersect(orig, dir, scene.spheres, scene.scene_bvh, scene.bvh_order, point, N, material)) {
-        float u = 0.5f + atan2f(dir.z, dir.x) * inv_pi * 0.5f;
-        float v = 0.5f - asinf(dir.y) * inv_pi;
+    const float inv_w = (1.0/width);
+    const float inv_h = (1.0/height);
 
-        int px = min(bg_width - 1, max(0, int(u * bg_width)));
-        int py = min(bg_height - 1, max(0, int(v * bg_height)));
+    // Calculate field of view
+    auto primary_dir = [&](size_t i, size_t j) {
+        float x =  (2*(i + 0.5) * inv_w - 1) * scale_aspect_prod;
+        float y = -(2*(j + 0.5) * inv_h - 1) * scale;
+        return Vec3f(x, y, -1).normalize();
+    };
 
-        int index = (py * bg_width + px) * 3;
-        float r = scene.bg_data[index] * inv_maxcol;
-        float g = scene.bg_data[index + 1] * inv_maxcol;
-        float b = scene.bg_data[index + 2] * inv_maxcol;
-        return Vec3f(r, g, b);
+    // Pixel edge direction, for tile frustum corners
+    auto edge_dir = [&](int i, int j) {
+        return Vec3f((2*i * inv_w - 1) * scale_aspect_prod, -(2*j * inv_h - 1) * scale, -1);
     };
 
-    Vec3f reflect_dir = reflect(dir, N).normalize();
-    Vec3f refract_dir = refract(dir, N, material.refractive_index).normalize();
+    const bool binary = scene.settings.bvh_layout == BVH_LAYOUT_BINARY;
+    const bool packets = scene.settings.packet_primary && binary;
+    const bool culling = scene.settings.tile_culling && binary;
+    if (packets || culling) {
+        const int tiles_x = (width + PACKET_SIZE - 1) / PACKET_SIZE;
+        const int tiles_y = (height + PACKET_SIZE - 1) / PACKET_SIZE;
+
+        // Multi-threaded rendering, one packet per tile
+        #pragma omp parallel for schedule(dynamic)
+        for (int tile = 0; tile < tiles_x * tiles_y; tile++) {
+            const int x0 = (tile % tiles_x) * PACKET_SIZE, y0 = (tile / tiles_x) * PACKET_SIZE;
+            const int x1 = min(x0 + PACKET_SIZE, width), y1 = min(y0 + PACKET_SIZE, height);
+            RayPacket packet;
+            packet.orig = Vec3f(0,0,0);
+            for (int j = y0; j < y1; j++) {
+                for (int i = x0; i < x1; i++) {
+                    Vec3f dir = primary_dir(i, j);
+                    packet.dx[packet.count] = dir.x; packet.dy[packet.count] = dir.y; packet.dz[packet.count] = dir.z;
+                    packet.count++;
+                }
+            }
+            init_ray_packet(packet);
+
+            vector<int> roots(1, 0);
+            if (culling) {
+                const Vec3f corner[4] = {edge_dir(x0, y0), edge_dir(x1, y0), edge_dir(x1, y1), edge_dir(x0, y1)};
+                tile_candidates(scene, make_tile_frustum(corner), roots);
+            }
+            if (packets) packet_closest_hit(packet, scene, roots);
+            else {
+                for (int r = 0; r < packet.count; r++) {
+                    Vec3f dir(packet.dx[r], packet.dy[r], packet.dz[r]);
+                    RayPrecomp ray(packet.orig, dir);
+                    for (int root : roots)
+                        bvh_closest_hit(packet.orig, dir, ray, scene, scene.scene_bvh, scene.bvh_order, packet.t[r], packet.sphere[r], nullptr, root);
+                }
+            }
 
-    Vec3f reflect_orig = reflect_dir*N < 0 ? point - N*1e-3 : point + N*1e-3; // Offset for no self-occlusion
-    Vec3f refract_orig = refract_dir*N < 0 ? point - N*1e-3 : point + N*1e-3;
+            int r = 0;
+            for (int j = y0; j < y1; j++) {
+                for (int i = x0; i < x1; i++, r++) {
+                    Vec3f dir(packet.dx[r], packet.dy[r], packet.dz[r]);
+                    Vec3f c;
+                    if (packet.sphere[r] < 0) c = background_color(dir, scene);
+                    else {
+                        Vec3f point, N;
+                        Material material;
+                        make_hit_record(packet.orig, dir, scene.spheres[packet.sphere[r]], packet.t[r], point, N, material);
+                        c = shade_hit(dir, point, N, material, scene);
+                    }
+                    store_pixel(framebuffer, (i + j*width) * 3, c);
+                }
+            }
+        }
+        return framebuffer;
+    }
 
-    Vec3f reflect_color = cast_ray(reflect_orig, reflect_dir, scene, depth + 1);
-    Vec3f refract_color = cast_ray(refract_orig, refract_dir, scene, depth + 1);
+    // Multi-threaded rendering
+    #pragma omp parallel for
+    for (size_t j = 0; j < height; j++) {
+        for (size_t i = 0; i < width; i++) {
+            // Create bytearray
+            Vec3f c = cast_ray(Vec3f(0,0,0), primary_dir(i, j), scene);
+            store_pixel(framebuffer, (i + j*width) * 3, c);
+        }
+    }
 
-    float diffuse_light_intensity = 0;
-    float specular_light_intensity = 0;
+    return framebuffer;
+}
 
-    for (size_t i=0; i<scene.lights.size(); i++) {
-        Vec3f to_light = scene.lights[i].position - point;
-        float light_distance = to_light.norm();
-        Vec3f light_dir = to_light * (1 / light_distance);
-        
-        // Check if point in shadow of lights[i]
-        Vec3f shadow_orig = light_dir*N < 0 ? point - N*1e-3 : point + N*1e-3;
-        Vec3f shadow_pt, shadow_N;
-        Material tmpmaterial;
-        if (bvh_scene_intersect(shadow_orig, light_dir, scene.spheres, scene.scene_bvh, scene.bvh_order, shadow_pt, shadow_N, tmpmaterial) && (shadow_pt-shadow_orig).norm() < light_distance)
-            continue;
+// Time a low-resolution trace through cast_ray, covering primary, secondary and shadow rays
+double time_sample_trace(const Scene &scene, int cols = 160, int rows = 90) {
+    const float scale = tan(scene.FOV/2.0f);
+    const float scale_aspect_prod = scale * frame_width / float(frame_height);
+    float checksum = 0.f;
 
-        diffuse_light_intensity  += scene.lights[i].intensity * max(0.f, light_dir*N);
-        specular_light_intensity += powf(max(0.f, reflect(light_dir, N)*dir), material.specular_exponent)*scene.lights[i].intensity;
+    auto t0 = chrono::steady_clock::now();
+    #pragma omp parallel for reduction(+:checksum)
+    for (int j = 0; j < rows; j++) {
+        for (int i = 0; i < cols; i++) {
+            float x =  (2*(i + 0.5f) / cols - 1) * scale_aspect_prod;
+            float y = -(2*(j + 0.5f) / rows - 1) * scale;
+            Vec3f c = cast_ray(Vec3f(0,0,0), Vec3f(x, y, -1).normalize(), scene);
+            checksum += c[0];
+        }
     }
+    auto t1 = chrono::steady_clock::now();
 
-    // See https://en.wikipedia.org/wiki/Phong_reflection_model#Concepts
-    return material.diffuse_color * diffuse_light_intensity * material.albedo[0] + Vec3f(1., 1., 1.)*specular_light_intensity * material.albedo[1] + reflect_color*material.albedo[2] + refract_color*material.albedo[3];
+    volatile float sink = checksum; // Keep the trace from being optimized away
+    (void)sink;
+    return chrono::duration<double, milli>(t1 - t0).count();
+}
+
+// Try builder, leaf size and SAH constant combinations on a low-res sample and keep the fastest
+BVHTuneResult tune_bvh(Scene &scene) {
+    BVHTuneResult result;
+    const RenderSettings original = scene.settings;
+    build_scene_bvh(scene);
+    result.default_ms = min(time_sample_trace(scene), time_sample_trace(scene));
+
+    const BVHBuilder builders[] = {BVH_BUILD_MEDIAN, BVH_BUILD_SAH, BVH_BUILD_MORTON};
+    const int leaf_sizes[] = {1, 2, 4, 8};
+    const float traversal_costs[] = {0.5f, 1.0f, 2.0f}; // Relative to intersect cost 1
+
+    RenderSettings best = original;
+    result.best_ms = numeric_limits<double>::infinity();
+    for (BVHBuilder builder : builders) {
+        for (int leaf_size : leaf_sizes) {
+            for (float traversal_cost : traversal_costs) {
+                // SAH constants only change the SAH builder's output
+                if (builder != BVH_BUILD_SAH && traversal_cost != 1.0f) continue;
+                RenderSettings candidate = original;
+                candidate.bvh_builder = builder;
+                candidate.max_leaf_size = leaf_size;
+                candidate.sah_traversal_cost = traversal_cost;
+                candidate.sah_intersect_cost = 1.0f;
+
+                scene.settings = candidate;
+                build_scene_bvh(scene);
+                double ms = min(time_sample_trace(scene), time_sample_trace(scene));
+                result.candidates++;
+                if (ms < result.best_ms) { result.best_ms = ms; best = candidate; }
+            }
+        }
+    }
+
+    scene.settings = best;
+    build_scene_bvh(scene);
+    return result;
+}
+
+// FNV-1a over sphere geometry so saved tuning only applies to the scene it was measured on
+unsigned long long scene_signature(const Scene &scene) {
+    unsigned long long h = 1469598103934665603ull;
+    auto mix = [&](const void *data, size_t size) {
+        const unsigned char *bytes = (const unsigned char *)data;
+        for (size_t i = 0; i < size; ++i) { h ^= bytes[i]; h *= 1099511628211ull; }
+    };
+    size_t n = scene.spheres.size();
+    mix(&n, sizeof(n));
+    for (const Sphere &sp : scene.spheres) {
+        mix(&sp.center.x, sizeof(float));
+        mix(&sp.center.y, sizeof(float));
+        mix(&sp.center.z, sizeof(float));
+        mix(&sp.radius, sizeof(float));
+    }
+    return h;
+}
+
+void save_bvh_tuning(const Scene &scene, const string &path) {
+    ofstream out(path);
+    if (!out) return;
+    out << "signature " << scene_signature(scene) << "\n";
+    out << "builder " << (int)scene.settings.bvh_builder << "\n";
+    out << "max_leaf_size " << scene.settings.max_leaf_size << "\n";
+    out << "sah_traversal_cost " << scene.settings.sah_traversal_cost << "\n";
+    out << "sah_intersect_cost " << scene.settings.sah_intersect_cost << "\n";
+}
+
+bool load_bvh_tuning(Scene &scene, const string &path) {
+    ifstream in(path);
+    if (!in) return false;
+    RenderSettings tuned = scene.settings;
+    unsigned long long signature = 0;
+    string key;
+    while (in >> key) {
+        if (key == "signature") in >> signature;
+        else if (key == "builder") {
+            int b = -1;
+            in >> b;
+            if (b < BVH_BUILD_MEDIAN || b > BVH_BUILD_MORTON) return false;
+            tuned.bvh_builder = (BVHBuilder)b;
+        }
+        else if (key == "max_leaf_size") in >> tuned.max_leaf_size;
+        else if (key == "sah_traversal_cost") in >> tuned.sah_traversal_cost;
+        else if (key == "sah_intersect_cost") in >> tuned.sah_intersect_cost;
+    }
+    if (signature != scene_signature(scene)) return false;
+    // Same range as the UI slider: 0 never terminates the build and the quantized layout stores counts in a byte
+    tuned.max_leaf_size = min(16, max(1, tuned.max_leaf_size));
+    scene.settings = tuned;
+    return true;
 }
 
-vector<unsigned char> render(const Scene &scene) {
+// Light-buffer render: the light-independent base (background seen directly or through
+// reflect / refract) and each light's colour at unit intensity, per pixel. Each pixel's ray
+// tree is traced once (trace_ray_tree), then its hits are shaded by every light individually,
+// whatever the integrator and light-cut settings. With ray_tree_cache the hits are kept, within
+// the memory budget, for relight_from_cache
+void render_light_buffers(const Scene &scene, LightBuffers &buffers) {
     const int width = frame_width;
     const int height = frame_height;
     const float scale = tan(scene.FOV/2.0f);
     const float scale_aspect_prod = scale * frame_width / float(frame_height);
-    vector<unsigned char> framebuffer(width * height * 3);
+    const size_t n = (size_t)width * height * 3;
+    const size_t lights = scene.lights.size();
+    buffers.base.assign(n, 0.f);
+    buffers.light.assign(lights, vector<float>(n, 0.f));
+    buffers.records.clear();
+    buffers.pixel_start.clear();
 
     const float inv_w = (1.0/width);
     const float inv_h = (1.0/height);
-    
-    // Multi-threaded rendering
+    vector<vector<HitRecord>> row_records(height);
+    vector<vector<int>> row_starts(height);
+    // Running size of the kept hits. Once past the budget no more are kept and light moves re-trace
+    const size_t budget = (size_t)scene.settings.ray_cache_max_mb << 20;
+    atomic<size_t> cached_bytes{0};
+    atomic<bool> over_budget{!scene.settings.ray_tree_cache};
+
     #pragma omp parallel for
-    for (size_t j = 0; j < height; j++) {
-        for (size_t i = 0; i < width; i++) {
-            // Calculate field of view
+    for (int j = 0; j < height; j++) {
+        vector<HitRecord> &records = row_records[j];
+        for (int i = 0; i < width; i++) {
             float x =  (2*(i + 0.5) * inv_w - 1) * scale_aspect_prod;
             float y = -(2*(j + 0.5) * inv_h - 1) * scale;
-            Vec3f dir = Vec3f(x, y, -1).normalize();
+            size_t first = records.size();
+            row_starts[j].push_back(first);
+            Vec3f base = trace_ray_tree(Vec3f(0,0,0), Vec3f(x, y, -1).normalize(), scene, records);
 
-            // Create bytearray
-            Vec3f c = cast_ray(Vec3f(0,0,0), dir, scene);
+            size_t idx = (i + j*width) * 3;
+            for (int k = 0; k < 3; k++) buffers.base[idx+k] = base[k];
+            for (size_t r = first; r < records.size(); r++) {
+                HitRecord &h = records[r];
+                if (h.sphere < 0) continue;
+                const Material &material = scene.spheres[h.sphere].material;
+                for (size_t l = 0; l < lights; l++) {
+                    Vec3f light_dir;
+                    if (!light_visible(h.point, h.N, scene, l, light_dir)) continue;
+                    h.visible |= 1 << l;
+                    Vec3f c = phong_colour(h.dir, h.N, light_dir, material);
+                    for (int k = 0; k < 3; k++) buffers.light[l][idx+k] += c[k] * h.weight;
+                }
+            }
 
-            float maxVal = max(c[0], max(c[1], c[2]));
-            if (maxVal > 1.f) c = c * (1.f / maxVal);
+            if (!over_budget.load(memory_order_relaxed)) {
+                size_t bytes = (records.size() - first) * sizeof(HitRecord);
+                if (cached_bytes.fetch_add(bytes, memory_order_relaxed) + bytes > budget) over_budget = true;
+            }
+            if (over_budget.load(memory_order_relaxed)) records.clear();
+        }
+        if (over_budget) records = vector<HitRecord>();
+    }
 
-            size_t idx = (i + j*width) * 3;
-            framebuffer[idx+0] = static_cast<unsigned char>(clamp(c[0], 0.f, 1.f) * 255.f);
-            framebuffer[idx+1] = static_cast<unsigned char>(clamp(c[1], 0.f, 1.f) * 255.f);
-            framebuffer[idx+2] = static_cast<unsigned char>(clamp(c[2], 0.f, 1.f) * 255.f);
+    if (over_budget) return;
+    size_t total = 0;
+    for (const vector<HitRecord> &records : row_records) total += records.size();
+    buffers.materials.clear();
+    for (const Sphere &sphere : scene.spheres) buffers.materials.push_back(sphere.material);
+    buffers.records.reserve(total);
+    buffers.pixel_start.reserve((size_t)width * height + 1);
+    for (int j = 0; j < height; j++) {
+        for (int start : row_starts[j]) buffers.pixel_start.push_back(buffers.records.size() + start);
+        buffers.records.insert(buffers.records.end(), row_records[j].begin(), row_records[j].end());
+        row_records[j] = vector<HitRecord>();
+    }
+    buffers.pixel_start.push_back(buffers.records.size());
+}
+
+// Re-shade one light's buffer from the cached hits after the light moved: its shadow rays and
+// Phong terms only, no primary or secondary rays
+void relight_from_cache(const Scene &scene, LightBuffers &buffers, int light) {
+    vector<float> &dst = buffers.light[light];
+    const int pixels = (int)buffers.pixel_start.size() - 1;
+
+    #pragma omp parallel for
+    for (int p = 0; p < pixels; p++) {
+        Vec3f sum(0, 0, 0);
+        for (int r = buffers.pixel_start[p]; r < buffers.pixel_start[p+1]; r++) {
+            HitRecord &h = buffers.records[r];
+            if (h.sphere < 0) continue;
+            Vec3f light_dir;
+            h.visible &= ~(1 << light);
+            if (!light_visible(h.point, h.N, scene, light, light_dir)) continue;
+            h.visible |= 1 << light;
+            Vec3f c = phong_colour(h.dir, h.N, light_dir, scene.spheres[h.sphere].material);
+            for (int k = 0; k < 3; k++) sum[k] += c[k] * h.weight;
         }
+        for (int k = 0; k < 3; k++) dst[p*3 + k] = sum[k];
     }
+}
 
-    return framebuffer;
+// Re-shade every buffer from the cached hits after material edits: path weights are redone
+// from the new albedos and the Phong terms from the cached shadow results, nothing is traced.
+// False (and nothing changed) when the cached ray tree no longer matches the scene: a changed
+// refractive index bends rays differently, and a branch that now passes worth_tracing was
+// never traced. Branches that no longer pass are dropped with their subtrees
+bool reshade_from_cache(const Scene &scene, LightBuffers &buffers) {
+    if (buffers.materials.size() != scene.spheres.size()) return false;
+    for (size_t i = 0; i < scene.spheres.size(); i++)
+        if (scene.spheres[i].material.refractive_index != buffers.materials[i].refractive_index) return false;
+
+    const int pixels = (int)buffers.pixel_start.size() - 1;
+    vector<float> weights(buffers.records.size());
+    bool covered = true;
+
+    // New weights, parents come before their children within a pixel
+    #pragma omp parallel for reduction(&&:covered)
+    for (int p = 0; p < pixels; p++) {
+        const int first = buffers.pixel_start[p];
+        for (int r = first; r < buffers.pixel_start[p+1]; r++) {
+            const HitRecord &h = buffers.records[r];
+            float w = 1.f;
+            if (h.parent >= 0) {
+                const Material &parent = scene.spheres[buffers.records[first + h.parent].sphere].material;
+                w = weights[first + h.parent] * parent.albedo[h.branch == BRANCH_REFLECT ? 2 : 3];
+                if (!worth_tracing(w, scene.settings)) w = 0.f;
+            }
+            weights[r] = w;
+            if (h.sphere < 0 || w == 0.f) continue;
+
+            const Material &material = scene.spheres[h.sphere].material;
+            bool reflect_needed = worth_tracing(w * material.albedo[2], scene.settings);
+            bool refract_needed = worth_tracing(w * material.albedo[3], scene.settings);
+            if (refract_needed) {
+                Vec3f refract_dir = refract(h.dir, h.N, material.refractive_index);
+                refract_needed = refract_dir*refract_dir > 0.f;
+            }
+            if ((reflect_needed && !(h.queued & 1 << BRANCH_REFLECT)) || (refract_needed && !(h.queued & 1 << BRANCH_REFRACT)))
+                covered = false;
+        }
+    }
+    if (!covered) return false;
+
+    const size_t lights = buffers.light.size();
+    #pragma omp parallel for
+    for (int p = 0; p < pixels; p++) {
+        if (buffers.pixel_start[p] == buffers.pixel_start[p+1]) continue; // Primary miss, base only
+        Vec3f base(0, 0, 0);
+        vector<Vec3f> sum(lights, Vec3f(0, 0, 0));
+        for (int r = buffers.pixel_start[p]; r < buffers.pixel_start[p+1]; r++) {
+            HitRecord &h = buffers.records[r];
+            h.weight = weights[r];
+            if (h.weight == 0.f) continue;
+            if (h.sphere < 0) {
+                base = base + h.point * h.weight;
+                continue;
+            }
+            const Material &material = scene.spheres[h.sphere].material;
+            for (size_t l = 0; l < lights; l++) {
+                if (!(h.visible & 1 << l)) continue;
+                Vec3f to_light = scene.lights[l].position - h.point;
+                Vec3f c = phong_colour(h.dir, h.N, to_light * (1 / to_light.norm()), material);
+                sum[l] = sum[l] + c * h.weight;
+            }
+        }
+        for (int k = 0; k < 3; k++) {
+            buffers.base[p*3 + k] = base[k];
+            for (size_t l = 0; l < lights; l++) buffers.light[l][p*3 + k] = sum[l][k];
+        }
+    }
+    for (size_t i = 0; i < scene.spheres.size(); i++) buffers.materials[i] = scene.spheres[i].material;
+    return true;
+}
+
+// Sum of the base and every light buffer scaled by the light's current intensity
+void composite_light_buffers(const LightBuffers &buffers, const vector<Light> &lights, vector<unsigned char> &framebuffer) {
+    vector<float> sum(buffers.base);
+    for (size_t l = 0; l < buffers.light.size(); l++) {
+        const float intensity = lights[l].intensity;
+        const float *src = buffers.light[l].data();
+        float *dst = sum.data();
+        const size_t n = sum.size();
+        for (size_t k = 0; k < n; k++) dst[k] += intensity * src[k];
+    }
+    framebuffer.resize(sum.size());
+    for (size_t idx = 0; idx < sum.size(); idx += 3) store_pixel(framebuffer, idx, Vec3f(sum[idx], sum[idx+1], sum[idx+2]));
+}
+
+// Light buffers match the scene while only intensities have changed since they were rendered
+bool light_buffers_usable(const Scene &scene, const LightBuffers &buffers) {
+    return scene.settings.light_buffers && !buffers.base.empty() && buffers.light.size() == scene.lights.size();
+}
+
+// Light moves can be re-shaded while the buffers are usable and their ray tree was kept
+bool ray_tree_cache_usable(const Scene &scene, const LightBuffers &buffers) {
+    return light_buffers_usable(scene, buffers) && scene.settings.ray_tree_cache && !buffers.pixel_start.empty();
+}
+
+// Shadow maps for preview renders, cleared so final renders trace exact shadow rays. A light's
+// map is only rebuilt when the spheres, its position or the resolution changed since
+void build_shadow_maps(Scene &scene, bool final_quality) {
+    if (!scene.settings.shadow_maps || final_quality) {
+        scene.shadow_maps.clear();
+        return;
+    }
+    const unsigned long long signature = scene_signature(scene);
+    scene.shadow_maps.resize(scene.lights.size());
+    for (size_t i = 0; i < scene.lights.size(); i++) {
+        ShadowCubeMap &map = scene.shadow_maps[i];
+        const Vec3f &p = scene.lights[i].position;
+        if (map.signature == signature && map.res == scene.settings.shadow_map_res && map.position.x == p.x && map.position.y == p.y && map.position.z == p.z) continue;
+        build_shadow_map(scene, i, map);
+        map.signature = signature;
+    }
 }
 
-int main() {
+// Rebuild acceleration structure and re-render, timing both for the stats panel.
+// Final-quality renders may spend extra build time on BVH optimization passes.
+void rebuild_and_render(Scene &scene, vector<unsigned char> &framebuffer, RenderStats &stats, LightBuffers &buffers, bool final_quality = false) {
+    auto t0 = chrono::steady_clock::now();
+    build_scene_bvh(scene, final_quality);
+    if (final_quality && scene.settings.profile_reorder && (scene.settings.bvh_layout == BVH_LAYOUT_BINARY || scene.settings.bvh_layout == BVH_LAYOUT_STACKLESS))
+        reorder_bvh_by_profile(scene);
+    auto t_bvh = chrono::steady_clock::now();
+    build_shadow_maps(scene, final_quality);
+    auto t1 = chrono::steady_clock::now();
+    stats.secondary_rays = 0;
+    ShadowOccluderCache::reset_all();
+    if (scene.settings.light_buffers && scene.lights.size() <= (size_t)LIGHT_BUFFER_MAX_LIGHTS) {
+        render_light_buffers(scene, buffers);
+        composite_light_buffers(buffers, scene.lights, framebuffer);
+    } else {
+        buffers = LightBuffers();
+        framebuffer = render(scene, &stats);
+    }
+    auto t2 = chrono::steady_clock::now();
+    ShadowOccluderCache::totals(stats.shadow_tests, stats.shadow_cache_hits);
+
+    stats.build_ms = chrono::duration<double, milli>(t_bvh - t0).count();
+    stats.shadow_map_ms = chrono::duration<double, milli>(t1 - t_bvh).count();
+    stats.render_ms = chrono::duration<double, milli>(t2 - t1).count();
+    stats.bvh_bytes = bvh_memory_bytes(scene);
+    stats.lazy_total = (int)scene.lazy_subtrees.size();
+    stats.lazy_built = lazy_subtrees_built(scene);
+    stats.sah_cost = stats.lazy_total ? 0.f : bvh_sah_cost(scene.scene_bvh, scene.settings);
+}
+
+int main(int argc, char *argv[]) {
+    // Materials Shapes Lights Backgrounds
+    map<string, Material> materials;
+    materials["ivory"] = Material(1.0, Vec4f(0.6, 0.3, 0.1, 0.0), Vec3f(0.4, 0.4, 0.3), 50.0);
+    materials["plastic"] = Material(1.0, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(0.3, 0.1, 0.1), 10.0);
+    materials["mirror"] = Material(1.0, Vec4f(0.0, 10.0, 0.8, 0.0), Vec3f(1.0, 1.0, 1.0), 1425.0);
+    materials["glass"] = Material(1.5, Vec4f(0.0, 0.5, 0.1, 0.8), Vec3f(0.6, 0.7, 0.8), 125.0);
+
+    vector<Sphere> spheres;
+    spheres.push_back(Sphere(Vec3f(-3,0,-16), 2.0f, materials["plastic"]));
+    spheres.push_back(Sphere(Vec3f(-1.0, -1.5, -12), 2.0f, materials["glass"]));
+    spheres.push_back(Sphere(Vec3f(1.5, -0.5, -18), 2.0f, materials["ivory"]));
+    spheres.push_back(Sphere(Vec3f(7.0, 5.0, -18.0), 4.0f, materials["mirror"]));
+
+    vector<Light> lights;
+    lights.push_back(Light(Vec3f(-20, 20, 20), 1.5));
+    lights.push_back(Light(Vec3f(30, 50, -25), 1.8));
+    lights.push_back(Light(Vec3f(30, 20, 30), 1.7));
+
+    Scene scene(spheres, lights, materials, 1.05); // 60 Deg FOV (Default)
+    load_bvh_tuning(scene, BVH_TUNING_PATH);
+
+    // --bvh-report prints the analysis of the startup scene and exits, headless
+    if (argc > 1 && string(argv[1]) == "--bvh-report") {
+        build_scene_bvh(scene);
+        print_bvh_report(analyze_bvh(scene), cout);
+        return 0;
+    }
+
     // Initialize
     SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS);
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, 0);
@@ -300,31 +2822,17 @@ int main() {
     style.WindowPadding = ImVec2(5, 5);
     style.ItemSpacing = ImVec2(8, 4);
     
-    // Materials Shapes Lights Backgrounds
-    map<string, Material> materials;
-    materials["ivory"] = Material(1.0, Vec4f(0.6, 0.3, 0.1, 0.0), Vec3f(0.4, 0.4, 0.3), 50.0);
-    materials["plastic"] = Material(1.0, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(0.3, 0.1, 0.1), 10.0);
-    materials["mirror"] = Material(1.0, Vec4f(0.0, 10.0, 0.8, 0.0), Vec3f(1.0, 1.0, 1.0), 1425.0);
-    materials["glass"] = Material(1.5, Vec4f(0.0, 0.5, 0.1, 0.8), Vec3f(0.6, 0.7, 0.8), 125.0);
-
-    vector<Sphere> spheres;
-    spheres.push_back(Sphere(Vec3f(-3,0,-16), 2.0f, materials["plastic"]));
-    spheres.push_back(Sphere(Vec3f(-1.0, -1.5, -12), 2.0f, materials["glass"]));
-    spheres.push_back(Sphere(Vec3f(1.5, -0.5, -18), 2.0f, materials["ivory"]));
-    spheres.push_back(Sphere(Vec3f(7.0, 5.0, -18.0), 4.0f, materials["mirror"]));
-
-    vector<Light> lights;
-    lights.push_back(Light(Vec3f(-20, 20, 20), 1.5));
-    lights.push_back(Light(Vec3f(30, 50, -25), 1.8));
-    lights.push_back(Light(Vec3f(30, 20, 30), 1.7));
-
-    Scene scene(spheres, lights, materials, 1.05); // 60 Deg FOV (Default)
     scene.bg_data = stbi_load("assets/church_of_lutherstadt.jpg", &bg_width, &bg_height, &bg_channels, 3);
-    build_bvh(scene.spheres, scene.scene_bvh, scene.bvh_order);
 
     // Framebuffer
     vector<unsigned char> framebuffer;
-    framebuffer = render(scene);
+    RenderStats stats;
+    LightBuffers light_buffers;
+    BVHReport report;
+    bool has_report = false;
+    BVHTuneResult tune;
+
+    rebuild_and_render(scene, framebuffer, stats, light_buffers);
 
     // Dynamic Rendering
     GLuint textureID;
@@ -355,6 +2863,9 @@ int main() {
 
         // Start a new ImGui frame
         bool updated = false;
+        bool intensity_edited = false; // Recomposited from the light buffers when they are usable
+        vector<int> moved_lights;      // Re-shaded from the ray-tree cache when it is usable
+        bool material_edited = false;  // Likewise, unless the ray tree itself changes
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplSDL3_NewFrame();
         ImGui::NewFrame();
@@ -385,20 +2896,24 @@ int main() {
                 if (ImGui::TreeNode(("Material##" + to_string(i)).c_str())) {
                     if (ImGui::Button(("Glass##" + to_string(i)).c_str())) {
                         s.material = materials["glass"];
-                        updated = true;
+                        material_edited = true;
                     }
                     if (ImGui::Button(("Ivory##" + to_string(i)).c_str())) {
                         s.material = materials["ivory"];
-                        updated = true;
+                        material_edited = true;
                     }
                     if (ImGui::Button(("Red Plastic##" + to_string(i)).c_str())) {
                         s.material = materials["plastic"];
-                        updated = true;
+                        material_edited = true;
                     }
                     if (ImGui::Button(("Mirror##" + to_string(i)).c_str())) {
                         s.material = materials["mirror"];
-                        updated = true;
+                        material_edited = true;
                     }
+                    material_edited |= ImGui::ColorEdit3(("Diffuse colour##" + to_string(i)).c_str(), &s.material.diffuse_color.x);
+                    material_edited |= ImGui::SliderFloat4(("Albedo##" + to_string(i)).c_str(), &s.material.albedo.x, 0.0f, 10.0f);
+                    material_edited |= ImGui::SliderFloat(("Specular exponent##" + to_string(i)).c_str(), &s.material.specular_exponent, 1.0f, 1500.0f);
+                    material_edited |= ImGui::SliderFloat(("Refractive index##" + to_string(i)).c_str(), &s.material.refractive_index, 1.0f, 3.0f);
                     ImGui::TreePop();
                 }
             }
@@ -414,13 +2929,15 @@ int main() {
             Light& s = scene.lights[i];
             if (ImGui::CollapsingHeader(("Light " + to_string(i+1)).c_str())) {
                 // Intensity
-                updated |= ImGui::SliderFloat(("Intensity##" + to_string(i)).c_str(), &s.intensity, 0.1f, 25.0f);
+                intensity_edited |= ImGui::SliderFloat(("Intensity##" + to_string(i)).c_str(), &s.intensity, 0.1f, 25.0f);
                 
                 // Position
                 if (ImGui::TreeNode(("Position##" + to_string(i)).c_str())) {
-                    updated |= ImGui::SliderFloat(("X##" + to_string(i)).c_str(), &s.position.x, -100.0f, 100.0f);
-                    updated |= ImGui::SliderFloat(("Y##" + to_string(i)).c_str(), &s.position.y, -100.0f, 100.0f);
-                    updated |= ImGui::SliderFloat(("Z##" + to_string(i)).c_str(), &s.position.z, -100.0f, 100.0f);
+                    bool moved = false;
+                    moved |= ImGui::SliderFloat(("X##" + to_string(i)).c_str(), &s.position.x, -100.0f, 100.0f);
+                    moved |= ImGui::SliderFloat(("Y##" + to_string(i)).c_str(), &s.position.y, -100.0f, 100.0f);
+                    moved |= ImGui::SliderFloat(("Z##" + to_string(i)).c_str(), &s.position.z, -100.0f, 100.0f);
+                    if (moved) moved_lights.push_back(i);
                     ImGui::TreePop();
                 }
     
@@ -428,9 +2945,106 @@ int main() {
         }
         ImGui::EndChild();
 
-        if (updated) {
-            build_bvh(scene.spheres, scene.scene_bvh, scene.bvh_order);
-            framebuffer = render(scene);           
+        ImGui::BeginChild("Render Panel", ImVec2(500, 400), true);
+        int layout = scene.settings.bvh_layout;
+        if (ImGui::Combo("BVH Layout##", &layout, "Binary\0Compact (32B)\0BVH4 (SIMD)\0BVH8 (SIMD)\0Quantized BVH4\0Binary (stackless)\0")) {
+            scene.settings.bvh_layout = (BVHLayout)layout;
+            updated = true;
+        }
+        int builder = scene.settings.bvh_builder;
+        if (ImGui::Combo("BVH Builder##", &builder, "Median\0Binned SAH\0Morton\0")) {
+            scene.settings.bvh_builder = (BVHBuilder)builder;
+            updated = true;
+        }
+        updated |= ImGui::SliderInt("Max leaf size##", &scene.settings.max_leaf_size, 1, 16);
+        updated |= ImGui::SliderFloat("SAH traversal cost##", &scene.settings.sah_traversal_cost, 0.1f, 4.0f);
+        updated |= ImGui::SliderFloat("SAH intersect cost##", &scene.settings.sah_intersect_cost, 0.1f, 4.0f);
+        if (ImGui::Button("Auto-tune BVH##")) {
+            tune = tune_bvh(scene);
+            save_bvh_tuning(scene, BVH_TUNING_PATH);
+            updated = true;
+        }
+        if (tune.candidates > 0)
+            ImGui::Text("Auto-tune: %d combos, sample %.1f ms -> %.1f ms", tune.candidates, tune.default_ms, tune.best_ms);
+        updated |= ImGui::Checkbox("Lazy BVH (binary layouts, preview)##", &scene.settings.lazy_bvh);
+        if (scene.settings.lazy_bvh) updated |= ImGui::SliderInt("Eager depth##", &scene.settings.lazy_eager_depth, 1, 20);
+        ImGui::Checkbox("Treelet optimization (final)##", &scene.settings.treelet_optimize);
+        ImGui::SliderFloat("Optimizer budget (ms)##", &scene.settings.treelet_budget_ms, 10.0f, 5000.0f);
+        ImGui::Checkbox("Profile-guided node order (final, binary)##", &scene.settings.profile_reorder);
+        updated |= ImGui::Checkbox("Packet primary rays (binary)##", &scene.settings.packet_primary);
+        updated |= ImGui::Checkbox("Tile frustum culling (binary)##", &scene.settings.tile_culling);
+        int integrator = scene.settings.integrator;
+        if (ImGui::Combo("Integrator##", &integrator, "Depth-first\0Wavefront\0")) {
+            scene.settings.integrator = (Integrator)integrator;
+            updated = true;
+        }
+        updated |= ImGui::SliderInt("Max depth##", &scene.settings.max_depth, 0, MAX_RAY_DEPTH);
+        updated |= ImGui::SliderFloat("Min branch contribution##", &scene.settings.min_contribution, 0.0f, 0.1f, "%.4f");
+        updated |= ImGui::Checkbox("Sort secondary rays (wavefront)##", &scene.settings.sort_secondary);
+        updated |= ImGui::Checkbox("Interleave rays with prefetch (wavefront, binary)##", &scene.settings.interleave_rays);
+        updated |= ImGui::Checkbox("Shadow occluder cache##", &scene.settings.shadow_cache);
+        updated |= ImGui::Checkbox("Shadow maps (previews, final render is exact)##", &scene.settings.shadow_maps);
+        if (scene.settings.shadow_maps) {
+            updated |= ImGui::SliderInt("Shadow map resolution##", &scene.settings.shadow_map_res, 64, 2048);
+            updated |= ImGui::SliderFloat("Shadow map bias (texels)##", &scene.settings.shadow_map_bias, 0.0f, 8.0f);
+        }
+        updated |= ImGui::Checkbox("Light cuts (16+ lights)##", &scene.settings.light_cuts);
+        updated |= ImGui::SliderFloat("Light cut error##", &scene.settings.light_cut_error, 0.001f, 0.2f, "%.3f");
+        updated |= ImGui::SliderInt("Light cut max nodes##", &scene.settings.light_cut_max, 1, 256);
+        updated |= ImGui::Checkbox("Light buffers, instant intensity edits (up to 8 lights)##", &scene.settings.light_buffers);
+        if (scene.settings.light_buffers) {
+            updated |= ImGui::Checkbox("Ray-tree cache for light moves and material edits##", &scene.settings.ray_tree_cache);
+            updated |= ImGui::SliderInt("Ray-tree cache budget (MB)##", &scene.settings.ray_cache_max_mb, 64, 4096);
+        }
+        bool final_render = ImGui::Button("Final Render##");
+        ImGui::Text("BVH build: %.2f ms  Render: %.1f ms", stats.build_ms, stats.render_ms);
+        ImGui::Text("BVH memory: %.1f KB  SAH cost: %.2f", stats.bvh_bytes / 1024.0, stats.sah_cost);
+        if (stats.composite_ms > 0) ImGui::Text("Last cached update: %.2f ms", stats.composite_ms);
+        if (!light_buffers.records.empty()) ImGui::Text("Ray-tree cache: %zu hits, %.1f MB", light_buffers.records.size(), light_buffers.records.size() * sizeof(HitRecord) / 1048576.0);
+        if (stats.lazy_total > 0) ImGui::Text("Lazy subtrees built: %d / %d", stats.lazy_built, stats.lazy_total);
+        if (!scene.shadow_maps.empty()) ImGui::Text("Shadow maps: %d x 6 x %d^2, built in %.1f ms", (int)scene.shadow_maps.size(), scene.settings.shadow_map_res, stats.shadow_map_ms);
+        if (stats.shadow_tests > 0) ImGui::Text("Shadow occluder cache: %.1f%% of %lld tests", 100.0 * stats.shadow_cache_hits / stats.shadow_tests, stats.shadow_tests);
+        if (stats.secondary_rays > 0) {
+            ImGui::Text("Secondary rays: %lld  Sort: %.1f ms  Extend: %.1f ms (thread time)", stats.secondary_rays, stats.secondary_sort_ms, stats.secondary_extend_ms);
+            if (stats.secondary_fetches > 0) ImGui::Text("Per secondary ray: %.2f node fetches, %.2f node cache misses", double(stats.secondary_fetches) / stats.secondary_rays, double(stats.secondary_node_misses) / stats.secondary_rays);
+        }
+        if (ImGui::CollapsingHeader("BVH Report##")) {
+            if (ImGui::Button("Analyze BVH##")) {
+                finalize_lazy_bvh(scene);
+                report = analyze_bvh(scene);
+                print_bvh_report(report, cout);
+                has_report = true;
+            }
+            if (has_report) {
+                ImGui::Text("Nodes: %d (%d leaves)  Memory: %.1f KB", report.node_count, report.leaf_count, report.memory_bytes / 1024.0);
+                ImGui::Text("SAH cost: %.2f  Sibling overlap: %.1f%%", report.sah_cost, report.sibling_overlap * 100.f);
+                ImGui::Text("Depth: max %d, avg leaf %.1f", report.max_depth, report.avg_leaf_depth);
+                string histogram = "Leaf sizes:";
+                for (size_t i = 1; i < report.leaf_histogram.size(); ++i) histogram += " " + to_string(i) + ":" + to_string(report.leaf_histogram[i]);
+                ImGui::TextUnformatted(histogram.c_str());
+                ImGui::Text("Node visits/ray: %.1f (primary %.1f, %d rays)", report.visits_per_ray, report.primary_visits_per_ray, report.sampled_rays);
+            }
+        }
+        ImGui::EndChild();
+
+        if (updated || final_render) {
+            rebuild_and_render(scene, framebuffer, stats, light_buffers, final_render);           
+        } else if (intensity_edited || !moved_lights.empty() || material_edited) {
+            // Intensity edits only recomposite, light moves first re-shade that light and material
+            // edits every buffer from the ray-tree cache
+            bool cached = moved_lights.empty() && !material_edited ? light_buffers_usable(scene, light_buffers) : ray_tree_cache_usable(scene, light_buffers);
+            auto t0 = chrono::steady_clock::now();
+            if (cached && material_edited) cached = reshade_from_cache(scene, light_buffers);
+            if (cached) {
+                for (int light : moved_lights) {
+                    if (light < (int)scene.shadow_maps.size()) build_shadow_map(scene, light, scene.shadow_maps[light]);
+                    relight_from_cache(scene, light_buffers, light);
+                }
+                composite_light_buffers(light_buffers, scene.lights, framebuffer);
+                stats.composite_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+            } else {
+                rebuild_and_render(scene, framebuffer, stats, light_buffers);
+            }
         }
         ImGui::End();
 
@@ -3,6 +3,9 @@
 #include <geometry.h>
 #include <algorithm>
 #include <map>
+#include <deque>
+#include <atomic>
+#include <mutex>
 #include <stb_image.h>
 
 using namespace std;
@@ -94,7 +97,366 @@ struct BVHNode {
     int right;  // Right child idx (or -1)
     int start;  // Start idx into ord primitive list (leaf)
     int count;  // N of primitives (leaf)
-    BVHNode() : left(-1), right(-1), start(-1), count(0) {}
+    int skip;   // Next node in depth-first order once this subtree is done or missed (-1 ends)
+    BVHNode() : left(-1), right(-1), start(-1), count(0), skip(-1) {}
+};
+
+const int BVH_MAX_DEPTH = 64;
+
+// 1/d with near-zero d clamped, so axis-parallel rays get a large finite inverse instead of inf (inf*0 = NaN in slab tests)
+inline float safe_inverse(float d) {
+    const float eps = 1e-20f;
+    return 1.f / (fabsf(d) < eps ? copysignf(eps, d) : d);
+}
+
+// Per-ray constants for slab tests, each plane then costs one FMA: t = plane * invdir - org_invdir
+struct RayPrecomp {
+    Vec3f invdir;
+    Vec3f org_invdir;
+    int sign[3]; // 1 where the ray points down the axis
+    RayPrecomp() {}
+    RayPrecomp(const Vec3f &orig, const Vec3f &dir) {
+        for (int a = 0; a < 3; ++a) {
+            invdir[a] = safe_inverse(dir[a]);
+            org_invdir[a] = orig[a] * invdir[a];
+            sign[a] = invdir[a] < 0.f;
+        }
+    }
+};
+
+// Subtree below a lazy stub node (count == -1, start = subtree idx), built by the first ray that reaches it
+struct LazyBVHSubtree {
+    LazyBVHSubtree(const vector<int> &idx, int d) : indices(idx), depth(d) {}
+    vector<int> indices;             // Primitives under the stub
+    int depth;                       // Depth of the stub in the eager tree
+    mutable vector<BVHNode> nodes;   // Local node idx, root at 0
+    mutable vector<int> order;       // Leaf start idx points in here
+    mutable once_flag built;
+    mutable atomic<bool> ready{false};
+};
+
+enum BVHLayout { BVH_LAYOUT_BINARY, BVH_LAYOUT_COMPACT, BVH_LAYOUT_WIDE4, BVH_LAYOUT_WIDE8, BVH_LAYOUT_QUANTIZED, BVH_LAYOUT_STACKLESS };
+
+// 32-byte node in depth-first order, two per cache line. Left child is implicitly the next node
+struct alignas(32) BVHCompactNode {
+    float minim[3];
+    float maxim[3];
+    int offset;          // Right child idx (inner) or start idx into ord primitive list (leaf)
+    unsigned int packed; // N of primitives in low 30 bits (0 for inner), split axis in top 2
+
+    int count() const { return (int)(packed & 0x3FFFFFFFu); }
+    int axis() const { return (int)(packed >> 30); }
+};
+static_assert(sizeof(BVHCompactNode) == 32, "BVHCompactNode must stay 32 bytes");
+
+// W-wide node collapsed from the binary tree, child bounds in SoA for SIMD tests
+template <int W>
+struct alignas(32) BVHWideNode {
+    static const int width = W;
+    float bounds[6][W]; // Child min x, y, z then max x, y, z
+    int child[W];       // Child node idx (inner) or start idx into ord primitive list (leaf)
+    int count[W];       // N of primitives (leaf), 0 for inner
+    int num_children;
+    BVHWideNode() : num_children(0) {
+        for (int i = 0; i < W; ++i) {
+            // Empty slots are a point at infinity so they never pass the slab test
+            for (int a = 0; a < 6; ++a) bounds[a][i] = numeric_limits<float>::infinity();
+            child[i] = -1;
+            count[i] = 0;
+        }
+    }
+};
+
+// 4-wide node with child bounds stored as 8-bit offsets on a power-of-two grid over the node box
+struct alignas(64) BVHQuantNode {
+    static const int width = 4;
+    float origin[3];          // Node box min
+    signed char exponent[3];  // Grid cell size per axis is 2^exponent
+    unsigned char num_children;
+    unsigned char qlo[3][4];  // Child box min in cells, rounded down
+    unsigned char qhi[3][4];  // Child box max in cells, rounded up
+    int child[4];             // Child node idx (inner) or start idx into ord primitive list (leaf)
+    unsigned char count[4];   // N of primitives (leaf), 0 for inner
+};
+static_assert(sizeof(BVHQuantNode) == 64, "BVHQuantNode must stay one cache line");
+
+struct RenderStats {
+    double build_ms = 0;
+    double render_ms = 0;
+    size_t bvh_bytes = 0;
+    float sah_cost = 0;      // 0 while lazy subtrees are pending
+    int lazy_total = 0;
+    int lazy_built = 0;
+
+    // Wavefront secondary rays, fetches counted on the binary layout only
+    long long secondary_rays = 0;
+    long long secondary_fetches = 0;
+    long long secondary_node_misses = 0; // Against a small simulated node cache
+    double secondary_sort_ms = 0;
+    double secondary_extend_ms = 0;
+
+    long long shadow_tests = 0;
+    long long shadow_cache_hits = 0;
+    double composite_ms = 0;
+    double shadow_map_ms = 0;
+};
+
+struct BVHReport {
+    int node_count = 0;
+    int leaf_count = 0;
+    int max_depth = 0;
+    float avg_leaf_depth = 0;
+    float sah_cost = 0;
+    float sibling_overlap = 0;   // Mean sibling intersection area over parent area
+    size_t memory_bytes = 0;
+    vector<int> leaf_histogram;  // Leaves per primitive count
+    int sampled_rays = 0;
+    float visits_per_ray = 0;
+    float primary_visits_per_ray = 0;
+};
+
+// Primary rays traced together, PACKET_SIZE x PACKET_SIZE pixels sharing the camera origin
+const int PACKET_SIZE = 8;
+const int PACKET_RAYS = PACKET_SIZE * PACKET_SIZE;
+const int PACKET_MIN_ACTIVE = 8; // Fewer rays left in a node and the packet splits into single rays
+
+struct RayPacket {
+    Vec3f orig;
+    int count = 0;
+    alignas(32) float dx[PACKET_RAYS], dy[PACKET_RAYS], dz[PACKET_RAYS];
+    alignas(32) float ix[PACKET_RAYS], iy[PACKET_RAYS], iz[PACKET_RAYS];
+    alignas(32) float t[PACKET_RAYS];
+    int sphere[PACKET_RAYS]; // Closest sphere per ray, -1 on miss
+
+    // Interval of inverse directions per axis, for culling nodes against the whole packet
+    float inv_lo[3], inv_hi[3];
+};
+
+// Independent rays advanced round-robin one traversal step at a time, so the prefetch issued
+// for a ray's next node or leaf lands while the rest of the group works
+const int RAY_GROUP_SIZE = 8;
+
+struct InterleavedRay {
+    enum Phase { DONE, CHILDREN, LEAF, LAZY }; // What the current node needs on the next turn
+    Phase phase = DONE;
+    Vec3f orig, dir;
+    RayPrecomp ray;
+    int node = 0;
+    int sp = 0;
+    int stack[BVH_MAX_DEPTH];
+    float stack_t[BVH_MAX_DEPTH];
+};
+
+// Secondary ray waiting on the shade_hit stack, weight is its throughput to the pixel
+const int MAX_RAY_DEPTH = 16;
+
+enum RayBranch { BRANCH_PRIMARY, BRANCH_REFLECT, BRANCH_REFRACT };
+
+struct PathVertex {
+    Vec3f orig, dir;
+    float weight;
+    int depth;
+    int parent = -1; // Spawning hit, only tracked by trace_ray_tree
+    int branch = BRANCH_PRIMARY;
+};
+
+// SoA ray queue for the wavefront integrator, rebuilt (compacted) between stages
+struct RayQueue {
+    vector<float> ox, oy, oz;
+    vector<float> dx, dy, dz;
+    vector<float> weight; // Scalar throughput to the pixel
+    vector<int> pixel;    // Pixel idx within the chunk
+    vector<float> t;      // Extend results
+    vector<int> sphere;
+
+    size_t size() const { return pixel.size(); }
+    void clear() {
+        ox.clear(); oy.clear(); oz.clear(); dx.clear(); dy.clear(); dz.clear();
+        weight.clear(); pixel.clear(); t.clear(); sphere.clear();
+    }
+    void push(const Vec3f &o, const Vec3f &d, float w, int px) {
+        ox.push_back(o.x); oy.push_back(o.y); oz.push_back(o.z);
+        dx.push_back(d.x); dy.push_back(d.y); dz.push_back(d.z);
+        weight.push_back(w); pixel.push_back(px);
+    }
+};
+
+// Shadow rays carry the light contribution they add if unoccluded
+struct ShadowQueue {
+    vector<float> ox, oy, oz;
+    vector<float> dx, dy, dz;
+    vector<float> t_max;
+    vector<float> cr, cg, cb;
+    vector<int> pixel;
+    vector<int> light;
+
+    size_t size() const { return pixel.size(); }
+    void clear() {
+        ox.clear(); oy.clear(); oz.clear(); dx.clear(); dy.clear(); dz.clear();
+        t_max.clear(); cr.clear(); cg.clear(); cb.clear(); pixel.clear(); light.clear();
+    }
+    void push(const Vec3f &o, const Vec3f &d, float tm, const Vec3f &c, int px, int l) {
+        ox.push_back(o.x); oy.push_back(o.y); oz.push_back(o.z);
+        dx.push_back(d.x); dy.push_back(d.y); dz.push_back(d.z);
+        t_max.push_back(tm); cr.push_back(c.x); cg.push_back(c.y); cb.push_back(c.z);
+        pixel.push_back(px); light.push_back(l);
+    }
+};
+
+// Last occluding sphere per light, one per render thread. Instances register themselves
+// so the hit counters can be reset and summed between frames
+struct ShadowOccluderCache {
+    vector<int> last; // Sphere idx per light, -1 when empty
+    long long tests = 0;
+    long long hits = 0;
+
+    inline static mutex registry_mutex;
+    inline static vector<ShadowOccluderCache*> registry;
+
+    ShadowOccluderCache() { lock_guard<mutex> lock(registry_mutex); registry.push_back(this); }
+    ~ShadowOccluderCache() { lock_guard<mutex> lock(registry_mutex); registry.erase(find(registry.begin(), registry.end(), this)); }
+
+    // Only between renders, while no thread is tracing
+    static void reset_all() {
+        lock_guard<mutex> lock(registry_mutex);
+        for (ShadowOccluderCache *c : registry) { c->last.clear(); c->tests = 0; c->hits = 0; }
+    }
+    static void totals(long long &tests, long long &hits) {
+        lock_guard<mutex> lock(registry_mutex);
+        tests = hits = 0;
+        for (ShadowOccluderCache *c : registry) { tests += c->tests; hits += c->hits; }
+    }
+};
+
+// Light hierarchy node, interior intensity is the sum over its lights
+struct LightNode {
+    AABB box;
+    float intensity = 0;
+    int left = -1, right = -1; // Children, -1 on leaves
+    int light = -1;            // Representative light, the light itself on leaves
+};
+
+// Light cuts are used from this many lights on, below it every light is shaded
+const int LIGHT_CUT_MIN_LIGHTS = 16;
+
+struct LightCutEntry {
+    float bound;    // Upper bound on the node's contribution, 0 on leaves (exact)
+    float estimate; // Unshadowed contribution through the representative
+    int node;
+    bool operator<(const LightCutEntry &o) const { return bound < o.bound; }
+};
+
+// Shadow ray goes to light, shading uses intensity (a cut node's total)
+struct LightSample {
+    int light;
+    float intensity;
+};
+
+// Per-light contribution buffers, interleaved RGB floats over the frame. The frame is
+// base + sum of intensity * light[i], so intensity edits only need a recomposite
+const int LIGHT_BUFFER_MAX_LIGHTS = 8; // Each buffer is 25 MB at 1920x1080
+
+// One node of a pixel's ray tree, enough to re-shade it without tracing
+struct HitRecord {
+    Vec3f point, N;              // On secondary misses (sphere -1) point holds the background colour
+    Vec3f dir;                   // Incoming ray
+    float weight;                // Path throughput to the pixel
+    int sphere = -1;             // Material comes from the sphere
+    int parent;                  // Spawning hit within the pixel's records, -1 for the primary hit
+    unsigned char branch;        // RayBranch from the parent
+    unsigned char queued = 0;    // Secondary branches traced from here, (1 << RayBranch) mask
+    unsigned char visible = 0;   // Lights reaching the hit, one bit each (LIGHT_BUFFER_MAX_LIGHTS)
+};
+
+struct LightBuffers {
+    vector<float> base;
+    vector<vector<float>> light;
+
+    // Ray-tree cache, pixel p's hits are records[pixel_start[p] .. pixel_start[p+1]),
+    // traced with the sphere materials below
+    vector<HitRecord> records;
+    vector<int> pixel_start;
+    vector<Material> materials;
+};
+
+// Distance from a light to the nearest sphere, over the 6 faces of a cube around it
+// (face = 2 * axis + negative, res x res texels each)
+struct ShadowCubeMap {
+    int res = 0;
+    vector<float> depth;
+    Vec3f position;                   // Light position and scene_signature it was built for
+    unsigned long long signature = 0;
+};
+
+// Primary-ray tile frustum, see tile_candidates
+const int TILE_MAX_CANDIDATES = 16;
+
+struct TileFrustum {
+    Vec3f normal[5]; // Planes through the camera origin, inward normals
+};
+
+enum Integrator { INTEGRATOR_DEPTH_FIRST, INTEGRATOR_WAVEFRONT };
+
+enum BVHBuilder { BVH_BUILD_MEDIAN, BVH_BUILD_SAH, BVH_BUILD_MORTON };
+
+struct BVHTuneResult {
+    int candidates = 0;
+    double default_ms = 0; // Sample trace time with the settings before tuning
+    double best_ms = 0;
+};
+
+struct RenderSettings {
+    BVHLayout bvh_layout = BVH_LAYOUT_BINARY;
+    BVHBuilder bvh_builder = BVH_BUILD_MEDIAN;
+    int max_leaf_size = 4;
+
+    // SAH cost model
+    float sah_traversal_cost = 1.0f;
+    float sah_intersect_cost = 1.0f;
+
+    // Lazy mode builds only the top levels up front (binary layout, preview builds)
+    bool lazy_bvh = false;
+    int lazy_eager_depth = 6;
+
+    // Treelet restructuring, final-quality builds only
+    bool treelet_optimize = true;
+    float treelet_budget_ms = 500.0f;
+
+    // Re-lay out scene_bvh from sampled traversals, final-quality static scenes
+    bool profile_reorder = false;
+
+    // Trace primary rays in packets, binary layout only
+    bool packet_primary = true;
+
+    // Start primary rays from the subtrees visible through their tile, binary layout only
+    bool tile_culling = true;
+
+    // Secondary bounces, and the throughput below which a branch is not traced (0 keeps all non-zero ones)
+    int max_depth = 4;
+    float min_contribution = 0.002f;
+
+    Integrator integrator = INTEGRATOR_DEPTH_FIRST;
+    bool sort_secondary = false; // Wavefront only
+    bool interleave_rays = false; // Wavefront only, binary layout
+
+    // Shade through a cut of the light hierarchy, refined while a node's error bound
+    // exceeds light_cut_error of the estimated total or until light_cut_max nodes
+    bool light_cuts = true;
+    float light_cut_error = 0.02f;
+    int light_cut_max = 32;
+
+    // Render into per-light buffers so intensity edits recomposite instead of re-tracing
+    bool light_buffers = false;
+    bool ray_tree_cache = false; // Keep the buffers' hit records so light moves and material edits only re-shade
+    int ray_cache_max_mb = 512;
+
+    // Test the last occluder per light before traversing for shadow rays
+    bool shadow_cache = true;
+
+    // Preview shadows from per-light cube depth maps instead of shadow rays
+    bool shadow_maps = false;
+    int shadow_map_res = 512;
+    float shadow_map_bias = 1.5f;
 };
 
 struct Scene {
@@ -108,6 +470,14 @@ struct Scene {
     unsigned char* bg_data = nullptr;
     vector<BVHNode> scene_bvh;
     vector<int> bvh_order;
+    vector<BVHCompactNode> scene_bvh_compact;
+    vector<BVHWideNode<4>> scene_bvh4;
+    vector<BVHWideNode<8>> scene_bvh8;
+    vector<BVHQuantNode> scene_bvh_quant;
+    deque<LazyBVHSubtree> lazy_subtrees;
+    vector<LightNode> light_bvh;
+    vector<ShadowCubeMap> shadow_maps; // Empty unless shadow_maps is on for a preview
+    RenderSettings settings;
 
     ~Scene() {if (bg_data) stbi_image_free(bg_data);}
 };
\ No newline at end of file